@@ -0,0 +1,249 @@
+#pragma once
+
+#include "filetree.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __unix__
+#include <pwd.h>
+#endif
+
+// Levels of a subtree smaller than this are totalled on one thread
+constexpr std::size_t PARALLEL_AGGREGATE_MIN_NODES = 1 << 16;
+
+enum class Attribute { EXTENSION, OWNER, AGE, NUM_ATTRIBUTES };
+
+/* ============== Breakdowns =====================
+ * Totals of the files below a directory by extension, owner and age, see
+ * NodeAttributes. Only files are counted, directories' own sizes are left
+ * out as their sizes are the sum of what is below them.
+ *
+ * The nodes below a directory aren't contiguous, but each level of them is
+ * a handful of runs: the children of neighbouring directories are next to
+ * each other, apart from where the tree has been changed since it was grown.
+ * So a subtree is totalled a level at a time, as a list of runs, split
+ * between threads when the level is big enough, and only the subtree's nodes
+ * are ever visited.
+ */
+
+struct AttributeTotal {
+  uintmax_t size = 0;
+  uintmax_t files = 0;
+};
+
+struct Breakdown {
+  // By id: extension id, owner id or Age
+  std::vector<AttributeTotal> totals[(int)Attribute::NUM_ATTRIBUTES];
+  AttributeTotal all;
+
+  // Ids of the attribute that have any files, largest first
+  std::vector<uint32_t> Ranked(Attribute a) const;
+};
+
+// Total up everything below dir, on num_threads threads (0 means one per
+// core)
+Breakdown Aggregate(const FileTree &tree, node_index_t dir,
+                    unsigned num_threads = 0);
+
+// The id a node has for an attribute
+uint32_t AttributeOf(const FileTree &tree, Attribute a, node_index_t i);
+
+// An attribute's value as text, e.g. ".jpg", a user name or "< 1 week"
+std::string AttributeName(const FileTree &tree, Attribute a, uint32_t id);
+
+namespace attribute_detail {
+
+// Totals and the runs of the next level, for part of a level
+struct Part {
+  Breakdown totals;
+  std::vector<NodeRange> next;
+};
+
+// Add r to the end of runs, joining it on to the last run if they touch
+inline void AddRun(std::vector<NodeRange> &runs, NodeRange r) {
+  if (!runs.empty() and runs.back().last == r.first) {
+    runs.back().last = r.last;
+  } else {
+    runs.push_back(r);
+  }
+}
+
+void Total(const FileTree &tree, NodeRange r, Part &part) {
+  const uintmax_t *sizes = tree.Sizes();
+  const File::Type *types = tree.Types();
+  const uint16_t *extensions = tree.ExtensionIds();
+  const uint16_t *owners = tree.OwnerIds();
+  const Age *ages = tree.Ages();
+  std::vector<AttributeTotal> *totals = part.totals.totals;
+
+  for (node_index_t i : r) {
+    if (types[i] == File::DIRECTORY) {
+      const NodeRange children = tree.Children(i);
+      if (!children.empty()) { AddRun(part.next, children); }
+      continue;
+    }
+    if (types[i] == File::EMPTY) { continue; }
+
+    const uintmax_t size = sizes[i];
+    AttributeTotal *t[] = {&totals[(int)Attribute::EXTENSION][extensions[i]],
+                           &totals[(int)Attribute::OWNER][owners[i]],
+                           &totals[(int)Attribute::AGE][(int)ages[i]],
+                           &part.totals.all};
+    for (AttributeTotal *a : t) {
+      a->size += size;
+      ++a->files;
+    }
+  }
+}
+
+void Resize(const FileTree &tree, Breakdown &b) {
+  b.totals[(int)Attribute::EXTENSION].resize(tree.NumExtensions());
+  b.totals[(int)Attribute::OWNER].resize(tree.NumOwners());
+  b.totals[(int)Attribute::AGE].resize((int)Age::NUM_AGES);
+}
+
+void Add(Breakdown &to, const Breakdown &from) {
+  for (int a = 0; a < (int)Attribute::NUM_ATTRIBUTES; ++a) {
+    for (std::size_t id = 0; id < from.totals[a].size(); ++id) {
+      to.totals[a][id].size += from.totals[a][id].size;
+      to.totals[a][id].files += from.totals[a][id].files;
+    }
+  }
+  to.all.size += from.all.size;
+  to.all.files += from.all.files;
+}
+
+} // namespace attribute_detail
+
+Breakdown Aggregate(const FileTree &tree, node_index_t dir,
+                    unsigned num_threads) {
+  using namespace attribute_detail;
+  PhaseTimer timer(Phase::AGGREGATE);
+
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  Part whole;
+  Resize(tree, whole.totals);
+  std::vector<NodeRange> level = {{dir, dir + 1}};
+  std::vector<Part> parts;
+  while (!level.empty()) {
+    std::size_t nodes = 0;
+    for (const NodeRange &r : level) {
+      nodes += r.size();
+    }
+
+    if (num_threads == 1 or nodes < PARALLEL_AGGREGATE_MIN_NODES) {
+      whole.next.clear();
+      for (const NodeRange &r : level) {
+        Total(tree, r, whole);
+      }
+      level.swap(whole.next);
+      continue;
+    }
+
+    // Each thread takes an equal share of the level's nodes, in order, so
+    // the next level's runs come out in order too
+    parts.assign(num_threads, Part());
+    auto work = [&](unsigned t) {
+      Resize(tree, parts[t].totals);
+      const std::size_t first = nodes * t / num_threads;
+      const std::size_t last = nodes * (t + 1) / num_threads;
+      std::size_t start = 0;
+      for (const NodeRange &r : level) {
+        const std::size_t end = start + r.size();
+        if (end > first and start < last) {
+          const std::size_t from = std::max(first, start) - start;
+          const std::size_t to = std::min(last, end) - start;
+          Total(tree,
+                {r.first + (node_index_t)from, r.first + (node_index_t)to},
+                parts[t]);
+        }
+        start = end;
+      }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < num_threads; ++t) {
+      threads.emplace_back(work, t);
+    }
+    work(0);
+    for (std::thread &t : threads) {
+      t.join();
+    }
+
+    level.clear();
+    for (const Part &p : parts) {
+      Add(whole.totals, p.totals);
+      for (const NodeRange &r : p.next) {
+        AddRun(level, r);
+      }
+    }
+  }
+  return whole.totals;
+}
+
+std::vector<uint32_t> Breakdown::Ranked(Attribute a) const {
+  const std::vector<AttributeTotal> &t = totals[(int)a];
+  std::vector<uint32_t> ids;
+  for (uint32_t id = 0; id < t.size(); ++id) {
+    if (t[id].files) { ids.push_back(id); }
+  }
+  std::sort(ids.begin(), ids.end(), [&](uint32_t x, uint32_t y) {
+    return t[x].size != t[y].size ? t[x].size > t[y].size : x < y;
+  });
+  return ids;
+}
+
+uint32_t AttributeOf(const FileTree &tree, Attribute a, node_index_t i) {
+  switch (a) {
+  case Attribute::EXTENSION: return tree.ExtensionIds()[i];
+  case Attribute::OWNER: return tree.OwnerIds()[i];
+  case Attribute::AGE: return (uint32_t)tree.Ages()[i];
+  case Attribute::NUM_ATTRIBUTES: break;
+  }
+  return 0;
+}
+
+std::string AttributeName(const FileTree &tree, Attribute a, uint32_t id) {
+  switch (a) {
+  case Attribute::EXTENSION: {
+    if (id == 0) { return "(none)"; }
+    return '.' + tree.ExtensionName((uint16_t)id);
+  }
+
+  case Attribute::OWNER: {
+    const uint32_t uid = tree.OwnerUid((uint16_t)id);
+    if (uid == File::NO_UID) { return "(unknown)"; }
+#ifdef __unix__
+    // Looking users up can mean asking a server, so only do it once each
+    static std::unordered_map<uint32_t, std::string> names;
+    auto it = names.find(uid);
+    if (it == names.end()) {
+      const passwd *pw = getpwuid((uid_t)uid);
+      it = names.emplace(uid, pw ? pw->pw_name : std::to_string(uid)).first;
+    }
+    return it->second;
+#else
+    return std::to_string(uid);
+#endif
+  }
+
+  case Attribute::AGE: {
+    static const char *const names[] = {
+        "< 1 day",   "< 1 week",  "< 1 month", "< 6 months",
+        "< 1 year",  "< 3 years", "older",     "(unknown)",
+    };
+    return id < (uint32_t)Age::NUM_AGES ? names[id] : "?";
+  }
+
+  case Attribute::NUM_ATTRIBUTES: break;
+  }
+  return "?";
+}
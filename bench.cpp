@@ -0,0 +1,339 @@
+// Benchmarks for each phase of filemap on a synthetic tree, see synthetic.h.
+// Build with `make bench`, run ./filemap-bench --help for the options.
+
+#include "SDL.h"
+#include "attributes.h"
+#include "filemap.h"
+#include "filetree.h"
+#include "report.h"
+#include "scanner.h"
+#include "synthetic.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+
+/* ===== Baseline =====
+ * The whole tree laid out up front, as the viewer did before TreeLayout, to
+ * compare the visible-only layout and hit test against. */
+
+// Lay out the children of dir inside rects[dir]
+void LayoutChildren(const FileTree &tree, SDL_FRect *rects, node_index_t dir) {
+  const NodeRange children = tree.Children(dir);
+  RowLayoutManager row_man(rects[dir], tree.GetFile(dir).size,
+                           tree.Sizes() + children.first,
+                           rects + children.first);
+  row_man.Add(children.size());
+}
+
+// Redo the layout below dir, keeping rects[dir] where it is
+void LayoutSubtree(const FileTree &tree, SDL_FRect *rects, node_index_t dir) {
+  std::vector<node_index_t> pending = {dir};
+  while (!pending.empty()) {
+    const node_index_t d = pending.back();
+    pending.pop_back();
+
+    LayoutChildren(tree, rects, d);
+    for (node_index_t c : tree.Children(d)) {
+      if (tree.GetFile(c).type == File::DIRECTORY) { pending.push_back(c); }
+    }
+  }
+}
+
+// Below this many nodes it isn't worth starting threads to do the layout
+constexpr std::size_t PARALLEL_LAYOUT_MIN_NODES = 1 << 16;
+
+// Lay out the whole tree in 'space', on num_threads threads (0 means one per
+// core)
+std::vector<SDL_FRect> MakeRects(const FileTree &tree, SDL_FRect space,
+                                 unsigned num_threads = 0) {
+  PhaseTimer timer(Phase::LAYOUT);
+  std::vector<SDL_FRect> rects(tree.Size(), SDL_FRect{0, 0, 0, 0});
+  rects[0] = space;
+
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (num_threads == 1 or tree.Size() < PARALLEL_LAYOUT_MIN_NODES) {
+    // Parents are always stored before their children
+    for (node_index_t rect = 0; rect < tree.Size(); ++rect) {
+      if (tree.GetFile(rect).type != File::DIRECTORY) { continue; }
+      LayoutChildren(tree, rects.data(), rect);
+    }
+    return rects;
+  }
+
+  // A directory's children only depend on its own rect, so once the top of
+  // the tree is laid out each subtree below it can be done independently.
+  // Go down level by level until there are enough subtrees to go round.
+  std::vector<node_index_t> subtrees = {0};
+  std::vector<node_index_t> next;
+  while (!subtrees.empty() and subtrees.size() < 16 * num_threads) {
+    next.clear();
+    for (node_index_t d : subtrees) {
+      LayoutChildren(tree, rects.data(), d);
+      for (node_index_t c : tree.Children(d)) {
+        if (tree.GetFile(c).type == File::DIRECTORY) { next.push_back(c); }
+      }
+    }
+    subtrees.swap(next);
+  }
+
+  // Biggest first, so the threads finish at about the same time
+  std::sort(subtrees.begin(), subtrees.end(),
+            [&](node_index_t a, node_index_t b) {
+              return tree.GetFile(a).size > tree.GetFile(b).size;
+            });
+
+  std::atomic<std::size_t> next_subtree(0);
+  auto worker = [&]() {
+    for (std::size_t i; (i = next_subtree++) < subtrees.size();) {
+      LayoutSubtree(tree, rects.data(), subtrees[i]);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread &t : threads) {
+    t.join();
+  }
+
+  return rects;
+}
+
+// The hit test that goes with MakeRects
+node_index_t FindMouseClick(const FileTree *tree, const SDL_FRect *rects, int x,
+                            int y) {
+  const SDL_FPoint p = {(float)x, (float)y};
+
+  node_index_t tightest_rect = 0;
+  NodeRange children = tree->Children(0);
+  while (!children.empty()) {
+    node_index_t hit = NULL_INDEX;
+    for (node_index_t i : children) {
+      if (SDL_PointInFRect(&p, &(rects[i]))) {
+        hit = i;
+        break;
+      }
+    }
+    if (hit == NULL_INDEX) { return tightest_rect; }
+
+    tightest_rect = hit;
+    children = tree->Children(hit);
+  }
+  return tightest_rect;
+}
+
+using BenchClock = std::chrono::steady_clock;
+
+struct BenchOptions {
+  SyntheticSpec spec;
+  // Also write the tree here and benchmark scanning it, ideally on a tmpfs
+  const char *disk = nullptr;
+  // Each benchmark is run this many times and the fastest is reported
+  int repeat = 3;
+  unsigned threads = 0;
+  std::size_t hit_tests = 1000000;
+  bool csv = false;
+};
+
+// Fastest of 'repeat' runs of f, in seconds. setup is run before each and
+// isn't timed.
+template <typename Setup, typename F>
+double Time(int repeat, Setup &&setup, F &&f) {
+  double best = 1e300;
+  for (int i = 0; i < repeat; ++i) {
+    setup();
+    const auto start = BenchClock::now();
+    f();
+    const std::chrono::duration<double> t = BenchClock::now() - start;
+    best = std::min(best, t.count());
+  }
+  return best;
+}
+
+template <typename F> double Time(int repeat, F &&f) {
+  return Time(repeat, [] {}, f);
+}
+
+void PrintResult(const BenchOptions &options, const char *phase,
+                 const char *unit, std::size_t items, double seconds) {
+  if (options.csv) {
+    std::printf("%s,%s,%zu,%.6f,%.0f\n", phase, unit, items, seconds,
+                items / seconds);
+  } else {
+    std::printf("%-22s %10zu %-10s %10.3f ms %14.0f %s/s\n", phase, items,
+                unit, seconds * 1000, items / seconds, unit);
+  }
+}
+
+void BenchScan(const BenchOptions &options) {
+  const fs::path root = fs::path(options.disk) / "filemap-bench";
+  fs::remove_all(root);
+  WriteSynthetic(*MakeSynthetic(options.spec, root));
+
+  // Scan in the background and wait quietly, Scan prints its progress
+  auto scan = [&](unsigned threads) {
+    ScanOptions scan_options;
+    scan_options.num_threads = threads;
+    ParallelScanner scanner(scan_options);
+    FileTree tree(root);
+    tree.GrowFrom(scanner.Start(root));
+    while (!scanner.Done()) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    tree.GrowReady();
+    return tree.Size();
+  };
+
+  std::size_t nodes = 0;
+  const double parallel =
+      Time(options.repeat, [&] { nodes = scan(options.threads); });
+  PrintResult(options, "scan", "nodes", nodes, parallel);
+
+  const double single = Time(options.repeat, [&] { nodes = scan(1); });
+  PrintResult(options, "scan (1 thread)", "nodes", nodes, single);
+
+  fs::remove_all(root);
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+  for (int i = 1; i < argc; ++i) {
+    auto next = [&]() { return i + 1 < argc ? argv[++i] : "0"; };
+    if (std::strcmp(argv[i], "--fanout") == 0) {
+      options.spec.fanout = (unsigned)std::strtoul(next(), nullptr, 10);
+    } else if (std::strcmp(argv[i], "--depth") == 0) {
+      options.spec.depth = (unsigned)std::strtoul(next(), nullptr, 10);
+    } else if (std::strcmp(argv[i], "--files") == 0) {
+      options.spec.files = (unsigned)std::strtoul(next(), nullptr, 10);
+    } else if (std::strcmp(argv[i], "--wide") == 0) {
+      options.spec.wide = std::strtoul(next(), nullptr, 10);
+    } else if (std::strcmp(argv[i], "--chain") == 0) {
+      options.spec.chain = (unsigned)std::strtoul(next(), nullptr, 10);
+    } else if (std::strcmp(argv[i], "--sizes") == 0) {
+      const char *d = next();
+      options.spec.sizes = std::strcmp(d, "equal") == 0 ? SizeDistribution::EQUAL
+                           : std::strcmp(d, "uniform") == 0
+                               ? SizeDistribution::UNIFORM
+                               : SizeDistribution::PARETO;
+    } else if (std::strcmp(argv[i], "--seed") == 0) {
+      options.spec.seed = std::strtoull(next(), nullptr, 10);
+    } else if (std::strcmp(argv[i], "--disk") == 0) {
+      options.disk = next();
+    } else if (std::strcmp(argv[i], "--repeat") == 0) {
+      options.repeat = std::max(1, std::atoi(next()));
+    } else if (std::strcmp(argv[i], "-j") == 0) {
+      options.threads = (unsigned)std::strtoul(next(), nullptr, 10);
+    } else if (std::strcmp(argv[i], "--hit-tests") == 0) {
+      options.hit_tests = std::strtoul(next(), nullptr, 10);
+    } else if (std::strcmp(argv[i], "--csv") == 0) {
+      options.csv = true;
+    } else {
+      std::printf(
+          "Usage: filemap-bench [--fanout N] [--depth N] [--files N] "
+          "[--wide N] [--chain N] [--sizes equal|uniform|pareto] [--seed N] "
+          "[--disk tmpfs-dir] [--repeat N] [-j threads] [--hit-tests N] "
+          "[--csv]\n");
+      return 0;
+    }
+  }
+
+  if (options.csv) {
+    std::printf("phase,unit,items,seconds,per_second\n");
+  }
+  if (options.disk) { BenchScan(options); }
+
+  // Growing uses up the listings, so make new ones for each run
+  const fs::path root = "synthetic";
+  std::unique_ptr<DirListing> listing;
+  std::unique_ptr<FileTree> tree;
+  const double grow = Time(
+      options.repeat,
+      [&] {
+        tree.reset();
+        listing = MakeSynthetic(options.spec, root);
+      },
+      [&] {
+        tree = std::make_unique<FileTree>(SyntheticRoot(root));
+        tree->Grow(*listing);
+      });
+  PrintResult(options, "grow", "nodes", tree->Size(), grow);
+
+  const SDL_FRect space = {0, 0, 1920, 1080};
+  std::vector<SDL_FRect> rects;
+  const double dense = Time(options.repeat, [&] {
+    rects = MakeRects(*tree, space, options.threads);
+  });
+  PrintResult(options, "layout (dense)", "rects", rects.size(), dense);
+
+  TreeLayout layout(tree.get());
+  const double lazy = Time(options.repeat, [&] {
+    layout.Build(space, space, 1, options.threads);
+  });
+  PrintResult(options, "layout (1px)", "rects", layout.Count(), lazy);
+
+  // The widest directory on its own
+  node_index_t widest = 0;
+  for (node_index_t i = 0; i < tree->Size(); ++i) {
+    if (tree->CountChildren(i) > tree->CountChildren(widest)) { widest = i; }
+  }
+  const NodeRange children = tree->Children(widest);
+  std::vector<SDL_FRect> row_rects(children.size());
+  const double rows = Time(options.repeat, [&] {
+    RowLayoutManager row_man(space, tree->GetFile(widest).size,
+                             tree->Sizes() + children.first, row_rects.data());
+    row_man.Add(children.size());
+  });
+  PrintResult(options, "row layout (widest)", "rects", children.size(),
+              rows);
+
+  std::mt19937 rng(options.spec.seed);
+  std::uniform_real_distribution<float> xs(0, space.w), ys(0, space.h);
+  std::vector<SDL_FPoint> points(options.hit_tests);
+  for (SDL_FPoint &p : points) {
+    p = {xs(rng), ys(rng)};
+  }
+  TreeLayout full(tree.get());
+  full.Build(space, space, 0, options.threads);
+  node_index_t checksum = 0;
+  const double hits = Time(options.repeat, [&] {
+    for (const SDL_FPoint &p : points) {
+      checksum += FindMouseClick(full, p.x, p.y);
+    }
+  });
+  PrintResult(options, "hit-test", "tests", points.size(), hits);
+
+  const double dense_hits = Time(options.repeat, [&] {
+    for (const SDL_FPoint &p : points) {
+      checksum += FindMouseClick(tree.get(), rects.data(), (int)p.x, (int)p.y);
+    }
+  });
+  PrintResult(options, "hit-test (linear)", "tests", points.size(),
+              dense_hits);
+
+  std::size_t levels = 0;
+  const double summary = Time(options.repeat, [&] {
+    levels = Summarise(*tree, 20).levels.size();
+  });
+  PrintResult(options, "report summary", "nodes", tree->Size(), summary);
+
+  uintmax_t files = 0;
+  const double aggregate = Time(options.repeat, [&] {
+    files = Aggregate(*tree, 0, options.threads).all.files;
+  });
+  PrintResult(options, "aggregate", "nodes", tree->Size(), aggregate);
+
+  // Stop the hit-tests, summary and totals being optimised away
+  if (checksum == 1 and levels == 0 and files == 0) { std::printf("\n"); }
+  return 0;
+}
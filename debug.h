@@ -4,11 +4,19 @@
 #include <cstdint>
 #include <filesystem>
 #include <iostream>
+#include <sstream>
+#include <string>
 
 class FormatSize {
 public:
   explicit FormatSize(std::uintmax_t s) : m_value(s) {}
   friend std::ostream &operator<<(std::ostream &os, FormatSize f);
+  // e.g. for ImGui
+  std::string str() const {
+    std::ostringstream os;
+    os << *this;
+    return os.str();
+  }
 
 private:
   std::uintmax_t m_value;
@@ -0,0 +1,290 @@
+#pragma once
+
+#include "filetree.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+/* ============== Diffs =====================
+ * What changed between two scans of the same root, as a tree of its own
+ * that can be shown and reported on like any other.
+ *
+ * The two trees are walked together a level at a time, pairing up each
+ * directory's children by name. FileOrder sorts directories by name, and
+ * files by size then name, so a directory whose files haven't changed size
+ * has its children in the same order in both trees and is paired up in one
+ * pass. Only directories where something moved need their files sorted by
+ * name first. Names are only compared with their siblings', paths are never
+ * built.
+ *
+ * Files that are the same size in both are left out. Everything else is
+ * sized by how much it changed (|after - before|, so an added or removed file
+ * counts in full) and a directory by the total change below it, so the map
+ * shows where the churn is. Whether each node grew or shrank overall is kept
+ * alongside, in TreeDiff::delta.
+ */
+
+struct TreeDiff {
+  // Every file that changed size, was added or was removed, and the
+  // directories above them. Attributes are from the later tree, where a node
+  // is in both.
+  FileTree tree;
+  // after - before for each node of tree
+  std::vector<intmax_t> delta;
+};
+
+// Compare two fully grown trees, usually a snapshot and a newer scan. Their
+// roots are paired whatever they are called, the diff is named after after's.
+TreeDiff DiffTrees(const FileTree &before, const FileTree &after);
+
+namespace diff_detail {
+
+// Where a node is only in one of the trees
+constexpr node_index_t NO_NODE = UINT32_MAX;
+
+// A node of the diff, before it is known whether it changed
+struct Pair {
+  node_index_t before;
+  node_index_t after;
+  // Index in the list of pairs
+  uint32_t parent;
+  File::Type type;
+  uintmax_t churn;
+  intmax_t delta;
+};
+
+// Aggregates' names change with how many files they hold, so they all
+// compare as "", which no real file is called
+inline const char *Key(const FileTree &tree, node_index_t i) {
+  return tree.Types()[i] == File::AGGREGATE ? "" : tree.GetName(i);
+}
+
+// Split dir's children into directories and everything else, keeping their
+// order, and return dir's own size, not counting its children
+uintmax_t Split(const FileTree &tree, node_index_t dir,
+                std::vector<node_index_t> &dirs,
+                std::vector<node_index_t> &files) {
+  dirs.clear();
+  files.clear();
+  if (dir == NO_NODE) { return 0; }
+
+  uintmax_t own = tree.Sizes()[dir];
+  for (node_index_t c : tree.Children(dir)) {
+    const File::Type type = tree.Types()[c];
+    if (type == File::EMPTY) { continue; }
+    (type == File::DIRECTORY ? dirs : files).push_back(c);
+    own -= tree.Sizes()[c];
+  }
+  return own;
+}
+
+// Sort nodes the way FileOrder sorts directories, if they aren't already,
+// e.g. after the watcher has reused some slots
+void SortByName(const FileTree &tree, std::vector<node_index_t> &nodes) {
+  auto by_name = [&](node_index_t a, node_index_t b) {
+    return std::strcmp(Key(tree, a), Key(tree, b)) > 0;
+  };
+  if (!std::is_sorted(nodes.begin(), nodes.end(), by_name)) {
+    std::sort(nodes.begin(), nodes.end(), by_name);
+  }
+}
+
+// Do two directories have children with the same names and types in the
+// same order. Siblings' names are usually one run of the name arena, so this
+// is a few memcmps rather than a strcmp per child.
+bool SameChildren(const FileTree &before, node_index_t b,
+                  const FileTree &after, node_index_t a) {
+  const NodeRange rb = before.Children(b), ra = after.Children(a);
+  const std::size_t n = rb.size();
+  if (n != ra.size()) { return false; }
+  if (n == 0) { return true; }
+  if (std::memcmp(before.Types() + rb.first, after.Types() + ra.first, n) !=
+      0) {
+    return false;
+  }
+
+  // Each name's offset from the first, which only match if the names are the
+  // same lengths. Names that aren't one run in order, e.g. after
+  // FileTree::Insert or Relocate, take the slow way.
+  const name_offset_t *ob = before.NameOffsets() + rb.first;
+  const name_offset_t *oa = after.NameOffsets() + ra.first;
+  for (std::size_t k = 0; k < n; ++k) {
+    // EMPTY slots don't have names of their own
+    if (before.Types()[rb.first + k] == File::EMPTY) { return false; }
+    if (k > 0 and (ob[k] <= ob[k - 1] or oa[k] <= oa[k - 1])) { return false; }
+    if (ob[k] - ob[0] != oa[k] - oa[0]) { return false; }
+  }
+  const std::size_t length =
+      ob[n - 1] - ob[0] + std::strlen(before.GetName(rb.last - 1)) + 1;
+  if (ob[0] + length > before.NamesSize() or
+      oa[0] + length > after.NamesSize()) {
+    return false;
+  }
+  // The run ends with a null, so every name starting in it also ends in it
+  return std::memcmp(before.Names() + ob[0], after.Names() + oa[0],
+                     length) == 0;
+}
+
+// Do two lists of children have the same names in the same order
+bool SameNames(const FileTree &before, const std::vector<node_index_t> &b,
+               const FileTree &after, const std::vector<node_index_t> &a) {
+  if (b.size() != a.size()) { return false; }
+  for (std::size_t k = 0; k < b.size(); ++k) {
+    if (std::strcmp(Key(before, b[k]), Key(after, a[k])) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Call pair(b, a) for each name in either list, both sorted by SortByName,
+// with NO_NODE for the list it isn't in
+template <typename F>
+void Merge(const FileTree &before, const std::vector<node_index_t> &b,
+           const FileTree &after, const std::vector<node_index_t> &a,
+           F &&pair) {
+  std::size_t i = 0, j = 0;
+  while (i < b.size() or j < a.size()) {
+    const int c = i == b.size()   ? -1
+                  : j == a.size() ? 1
+                                  : std::strcmp(Key(before, b[i]),
+                                                Key(after, a[j]));
+    // Names are in descending order, so the larger one comes first
+    if (c == 0) {
+      pair(b[i++], a[j++]);
+    } else if (c > 0) {
+      pair(b[i++], NO_NODE);
+    } else {
+      pair(NO_NODE, a[j++]);
+    }
+  }
+}
+
+} // namespace diff_detail
+
+TreeDiff DiffTrees(const FileTree &before, const FileTree &after) {
+  using namespace diff_detail;
+  assert(before.IsFullyGrown() and after.IsFullyGrown());
+  PhaseTimer timer(Phase::DIFF);
+
+  // Breadth-first, with each directory's children together, directories
+  // first, the same as a FileTree. Only directories and changed files are
+  // added, so most of the nodes of two similar trees never get here.
+  std::vector<Pair> pairs = {
+      {0, 0, 0, File::DIRECTORY, 0, (intmax_t)0}};
+  std::vector<node_index_t> before_dirs, before_files, after_dirs,
+      after_files;
+  std::vector<Pair> files;
+  for (uint32_t p = 0; p < pairs.size(); ++p) {
+    if (pairs[p].type != File::DIRECTORY) { continue; }
+
+    const uintmax_t own_before =
+        Split(before, pairs[p].before, before_dirs, before_files);
+    const uintmax_t own_after =
+        Split(after, pairs[p].after, after_dirs, after_files);
+    pairs[p].delta = (intmax_t)own_after - (intmax_t)own_before;
+    pairs[p].churn = (uintmax_t)std::abs(pairs[p].delta);
+
+    files.clear();
+    auto add_file = [&](node_index_t b, node_index_t a) {
+      const uintmax_t size_before = b == NO_NODE ? 0 : before.Sizes()[b];
+      const uintmax_t size_after = a == NO_NODE ? 0 : after.Sizes()[a];
+      if (size_before == size_after) { return; }
+      const intmax_t delta = (intmax_t)size_after - (intmax_t)size_before;
+      const File::Type type =
+          a == NO_NODE ? before.Types()[b] : after.Types()[a];
+      files.push_back({b, a, p, type, (uintmax_t)std::abs(delta), delta});
+    };
+    auto add_dir = [&](node_index_t b, node_index_t a) {
+      pairs.push_back({b, a, p, File::DIRECTORY, 0, (intmax_t)0});
+    };
+
+    // Usually nothing has been added, removed or renamed, so the children
+    // line up one to one
+    if (pairs[p].before != NO_NODE and pairs[p].after != NO_NODE and
+        SameChildren(before, pairs[p].before, after, pairs[p].after)) {
+      for (std::size_t k = 0; k < after_dirs.size(); ++k) {
+        add_dir(before_dirs[k], after_dirs[k]);
+      }
+      for (std::size_t k = 0; k < after_files.size(); ++k) {
+        add_file(before_files[k], after_files[k]);
+      }
+    } else {
+      SortByName(before, before_dirs);
+      SortByName(after, after_dirs);
+      Merge(before, before_dirs, after, after_dirs, add_dir);
+      if (SameNames(before, before_files, after, after_files)) {
+        for (std::size_t k = 0; k < after_files.size(); ++k) {
+          add_file(before_files[k], after_files[k]);
+        }
+      } else {
+        SortByName(before, before_files);
+        SortByName(after, after_files);
+        Merge(before, before_files, after, after_files, add_file);
+      }
+    }
+    // Biggest change first, as a scan sorts the biggest file first
+    std::stable_sort(files.begin(), files.end(),
+                     [](const Pair &x, const Pair &y) {
+                       return x.churn > y.churn;
+                     });
+    pairs.insert(pairs.end(), files.begin(), files.end());
+  }
+
+  // Children always come after their parents
+  for (std::size_t p = pairs.size(); p-- > 1;) {
+    pairs[pairs[p].parent].churn += pairs[p].churn;
+    pairs[pairs[p].parent].delta += pairs[p].delta;
+  }
+
+  TreeDiff diff{FileTree(), {}};
+  FileTree &tree = diff.tree;
+  tree.m_scan_time = after.m_scan_time;
+
+  // Attribute ids of each tree, as ids of the diff
+  std::vector<uint16_t> extensions[2], owners[2];
+  const FileTree *sources[2] = {&before, &after};
+  for (int s = 0; s < 2; ++s) {
+    for (const std::string &e : sources[s]->m_extensions) {
+      extensions[s].push_back(tree.InternExtension(e));
+    }
+    for (uint32_t uid : sources[s]->m_owners) {
+      owners[s].push_back(uid == File::NO_UID ? 0 : tree.OwnerId(uid));
+    }
+  }
+
+  // Unchanged directories are left out along with everything below them,
+  // which leaves each directory's remaining children still together
+  std::vector<node_index_t> index(pairs.size(), NULL_INDEX);
+  for (uint32_t p = 0; p < pairs.size(); ++p) {
+    const Pair &pair = pairs[p];
+    if (p > 0 and pair.churn == 0) { continue; }
+
+    const int s = pair.after == NO_NODE ? 0 : 1;
+    const FileTree &source = *sources[s];
+    const node_index_t n = s ? pair.after : pair.before;
+    const char *name = source.GetName(n);
+    const NodeAttributes attributes = {extensions[s][source.m_extension[n]],
+                                       owners[s][source.m_owner[n]],
+                                       source.m_age[n]};
+
+    const node_index_t parent = p == 0 ? NULL_INDEX : index[pair.parent];
+    index[p] = (node_index_t)tree.Size();
+    tree.AddNode(pair.churn, parent, tree.AddName(name, std::strlen(name)),
+                 pair.type, attributes);
+    if (p > 0) {
+      if (tree.m_child_count[parent] == 0) {
+        tree.m_first_child.Mut(parent) = index[p];
+      }
+      ++tree.m_child_count.Mut(parent);
+    }
+    diff.delta.push_back(pair.delta);
+  }
+  tree.m_grow_index = (node_index_t)tree.Size();
+  tree.ShrinkToFit();
+  return diff;
+}
@@ -2,26 +2,36 @@
 
 #include "debug.h"
 #include "filetree.h"
+#include "stats.h"
 
 #include "SDL.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // Take a FileTree and turn it into SDL_Rects for displaying
 
 // A lot of this could be re-done more simply using relative sizes
 
+// A run of elements being placed together, as an index range [first, last)
+// into the sizes being laid out
 struct Row {
+  std::size_t first = 0;
+  std::size_t last = 0;
+
   uintmax_t min_size;
   uintmax_t max_size;
   uintmax_t total_size = 0;
 
-  std::vector<uintmax_t> m_elements;
-
-  void Clear()
+  // Start a new, empty row at index i
+  void Clear(std::size_t i)
   {
+    first = last = i;
     total_size = 0;
-    m_elements.clear();
   }
 
   void Add(uintmax_t size)
@@ -35,24 +45,32 @@ struct Row {
         total_size += size;
       }
     }
-    m_elements.push_back(size);
+    ++last;
   }
 };
 
+// Where a finished row starts, for finding which element a point is in
+struct RowStart {
+  uint32_t first;
+  // Elements go left to right along the row, otherwise top to bottom
+  bool portrait;
+};
+
 struct Rect : SDL_FRect {
   uintmax_t size;
 };
 
-// The most 'squished' file rect possible if 'row' is placed in a 'space'
-inline float GetWorstAspectRatio(const Row &row, const Rect &space)
+// The most 'squished' file rect possible if a row with these sizes is placed
+// in a 'space'
+inline double GetWorstAspectRatio(uintmax_t total_size, uintmax_t min_size,
+                                  uintmax_t max_size, const Rect &space)
 {
-  float a = (space.w > space.h) ? space.w : space.h;
-  float b = (space.w > space.h) ? space.h : space.w;
+  double a = (space.w > space.h) ? space.w : space.h;
+  double b = (space.w > space.h) ? space.h : space.w;
 
-  // TODO - avoid problems with large numbers
-  float t = (float)(a * (float)row.total_size * (float)row.total_size) /
-            (b * (float)space.size);
-  return std::max(t / (float)row.min_size, (float)row.max_size / t);
+  double t = (a * (double)total_size * (double)total_size) /
+             (b * (double)space.size);
+  return std::max(t / (double)min_size, (double)max_size / t);
 }
 
 // We have an unfinished row in a total space of total_size, does adding
@@ -60,45 +78,73 @@ inline float GetWorstAspectRatio(const Row &row, const Rect &space)
 inline bool AddingReducesAspect(const Row &row, const Rect &space,
                                 uintmax_t next_size)
 {
-  if (space.size == 0 or row.total_size == 0) { return true; }
+  if (space.size == 0 or row.total_size == 0 or next_size == 0) {
+    return true;
+  }
 
-  Row after = row;
-  after.Add(next_size);
-  return GetWorstAspectRatio(after, space) <= GetWorstAspectRatio(row, space);
+  const double before = GetWorstAspectRatio(row.total_size, row.min_size,
+                                            row.max_size, space);
+  const double after = GetWorstAspectRatio(
+      row.total_size + next_size, std::min(row.min_size, next_size),
+      std::max(row.max_size, next_size), space);
+  return after <= before;
 }
 
-// This class converts file sizes to rects and places them aesthetically
+// This class converts file sizes to rects and places them aesthetically.
+// It never allocates, rows are just index ranges into the sizes.
+//
+// Each row is cut from the top or left of the space left, so the space left
+// before each row is nested inside the one before, and elements are placed
+// in order along their row. Empty elements get a zero sized rect at the
+// position they would start at, so this order holds for them too.
 class RowLayoutManager {
 public:
-  // _parent_rect represents a directory of _parent_size
+  // _parent_rect represents a directory of _parent_size. Each Add places the
+  // next of 'sizes' (sorted largest first), and the rect for sizes[i] is
+  // written to out[i]. If rows is given, where each row starts is added to
+  // it, see TreeLayout::ChildAt.
   RowLayoutManager(SDL_FRect _parent_rect, uintmax_t _parent_size,
-                   std::vector<SDL_FRect> &out)
+                   const uintmax_t *sizes, SDL_FRect *out,
+                   std::vector<RowStart> *rows = nullptr)
       : m_parent_rect{_parent_rect, _parent_size},
-        m_remaining_rect(m_parent_rect), m_current_row(), m_out_rects(out)
+        m_remaining_rect(m_parent_rect), m_current_row(), m_sizes(sizes),
+        m_out_rects(out), m_rows(rows)
   {}
 
-  ~RowLayoutManager()
-  {
-    if (m_current_row.total_size != 0) { FinishRow(); }
-  }
+  ~RowLayoutManager() { FinishRow(); }
 
-  void Add(uintmax_t size)
+  // Place the next 'count' elements
+  void Add(std::size_t count = 1)
   {
     if (m_parent_rect.w < 1 or m_parent_rect.h < 1) {
-      m_out_rects.push_back({0, 0, 0, 0});
+      for (std::size_t i = 0; i < count; ++i) {
+        m_out_rects[m_current_row.last++] = {0, 0, 0, 0};
+      }
+      m_current_row.first = m_current_row.last;
       return;
     }
-    if (!AddingReducesAspect(m_current_row, m_remaining_rect, size)) {
-      FinishRow();
-    }
 
-    m_current_row.Add(size);
+    for (std::size_t i = 0; i < count; ++i) {
+      const uintmax_t size = m_sizes[m_current_row.last];
+      if (!AddingReducesAspect(m_current_row, m_remaining_rect, size)) {
+        FinishRow();
+      }
+      m_current_row.Add(size);
+    }
   }
 
 private:
   void FinishRow()
   {
-    if (m_current_row.total_size == 0) { return; }
+    Row &row = m_current_row;
+    if (row.total_size == 0) {
+      // Nothing but empty files
+      for (std::size_t i = row.first; i < row.last; ++i) {
+        m_out_rects[i] = {0, 0, 0, 0};
+      }
+      row.Clear(row.last);
+      return;
+    }
     // End the temp row and place it.
 
     // If total_space is landscape (wider than tall) row takes a
@@ -108,69 +154,58 @@ private:
 
     bool portrait = m_remaining_rect.h > m_remaining_rect.w;
     SDL_FRect row_space = m_remaining_rect;
-
+    if (m_rows) { m_rows->push_back({(uint32_t)row.first, portrait}); }
+    uintmax_t row_remaining = row.total_size;
 
     if (portrait) {
-      float y_split = m_remaining_rect.h * (float)m_current_row.total_size /
+      float y_split = m_remaining_rect.h * (float)row.total_size /
                       (float)m_remaining_rect.size;
       row_space.h = y_split;
       m_remaining_rect.y += y_split;
       m_remaining_rect.h -= y_split;
-      m_remaining_rect.size -= m_current_row.total_size;
+      m_remaining_rect.size -= row.total_size;
 
-      for (uintmax_t size : m_current_row.m_elements) {
+      for (std::size_t i = row.first; i < row.last; ++i) {
+        const uintmax_t size = m_sizes[i];
         if (size == 0) {
-          m_out_rects.push_back({0, 0, 0, 0});
+          m_out_rects[i] = {row_space.x, row_space.y, 0, 0};
           continue;
         }
 
         SDL_FRect ele_rect = row_space;
-        ele_rect.w *= (float)size / (float)m_current_row.total_size;
-        m_out_rects.push_back(ele_rect);
-
-        // If density is changing drastically we have a problem
-        float d = (ele_rect.w * ele_rect.h) / (float)size;
-
-        float p =
-            (m_parent_rect.w * m_parent_rect.h) / (float)m_parent_rect.size;
-        //assert(0.8f * p < d and d < 1.2f * p);
+        ele_rect.w *= (float)size / (float)row_remaining;
+        m_out_rects[i] = ele_rect;
 
         row_space.x += ele_rect.w;
         row_space.w -= ele_rect.w;
-        m_current_row.total_size -= size;
+        row_remaining -= size;
       }
 
     } else {
-      float x_split = m_remaining_rect.w * (float)m_current_row.total_size /
+      float x_split = m_remaining_rect.w * (float)row.total_size /
                       (float)m_remaining_rect.size;
       row_space.w = x_split;
       m_remaining_rect.x += x_split;
       m_remaining_rect.w -= x_split;
-      m_remaining_rect.size -= m_current_row.total_size;
+      m_remaining_rect.size -= row.total_size;
 
-      for (uintmax_t size : m_current_row.m_elements) {
+      for (std::size_t i = row.first; i < row.last; ++i) {
+        const uintmax_t size = m_sizes[i];
         if (size == 0) {
-          m_out_rects.push_back({0, 0, 0, 0});
+          m_out_rects[i] = {row_space.x, row_space.y, 0, 0};
           continue;
         }
         SDL_FRect ele_rect = row_space;
-        ele_rect.h *= (float)size / (float)m_current_row.total_size;
-        m_out_rects.push_back(ele_rect);
-
-        // If density is changing drastically we have a problem
-        float d = (ele_rect.w * ele_rect.h) / (float)size;
-
-        float p =
-            (m_parent_rect.w * m_parent_rect.h) / (float)m_parent_rect.size;
-        //assert(0.8f * p < d and d < 1.2f * p);
+        ele_rect.h *= (float)size / (float)row_remaining;
+        m_out_rects[i] = ele_rect;
 
         row_space.y += ele_rect.h;
         row_space.h -= ele_rect.h;
-        m_current_row.total_size -= size;
+        row_remaining -= size;
       }
     }
 
-    m_current_row.Clear();
+    row.Clear(row.last);
   }
 
 private:
@@ -180,34 +215,417 @@ private:
   Rect m_remaining_rect;
   Row m_current_row;
 
-  std::vector<SDL_FRect> &m_out_rects;
+  const uintmax_t *m_sizes;
+  SDL_FRect *m_out_rects;
+  std::vector<RowStart> *m_rows;
 };
 
-node_index_t FindMouseClick(const FileTree *tree, const SDL_FRect *rects, int x,
-                            int y)
+/* ============== TreeLayout =====================
+ * Rects for the part of a FileTree that is big enough to see. A directory's
+ * children are only laid out ('expanded') if the directory is at least
+ * min_size wide and tall and overlaps the view, anything smaller is drawn as a
+ * single rect for the whole directory. Zooming in or panning expands more with
+ * Refine.
+ *
+ * Rects are stored in blocks, one per expanded directory, holding the rects of
+ * its children in child order. Blocks are stored in the order they were laid
+ * out so parents always come before their children, and memory and layout
+ * time depend on how much is visible rather than on the size of the tree.
+ */
+
+class TreeLayout {
+public:
+  // Marks a rect that is no longer used, see Relayout
+  static constexpr node_index_t NO_NODE = UINT32_MAX;
+
+  explicit TreeLayout(const FileTree *tree = nullptr)
+      : m_tree(tree), m_space{0, 0, 0, 0}, m_view{0, 0, 0, 0},
+        m_min_size(0), m_garbage(0)
+  {}
+
+  // Lay out from scratch in 'space', on num_threads threads (0 means one per
+  // core). min_size == 0 expands everything with a non-zero area.
+  void Build(SDL_FRect space, SDL_FRect view, float min_size,
+             unsigned num_threads = 0);
+  // Expand anything that is now visible and big enough, e.g. after zooming
+  // in. Returns true if anything new was laid out.
+  bool Refine(SDL_FRect view, float min_size);
+  // The children of dir have changed, lay out everything below it again
+  void Relayout(node_index_t dir);
+
+  // The rect of node i, zero sized if it hasn't been laid out
+  SDL_FRect GetRect(node_index_t i) const;
+  // The rects of dir's children in child order, or nullptr if dir hasn't
+  // been expanded
+  const SDL_FRect *ChildRects(node_index_t dir) const;
+  // The child of dir whose rect contains p, or NULL_INDEX. Takes log time in
+  // the number of children.
+  node_index_t ChildAt(node_index_t dir, SDL_FPoint p) const;
+  // Call f(node, rect, depth) for every laid out rect with some area that
+  // overlaps 'area', parents before their children, without going inside
+  // directories smaller than min_size
+  template <typename F>
+  void ForEachIn(SDL_FRect area, float min_size, F &&f) const;
+
+  // Every rect laid out and the node it belongs to (or NO_NODE), parents
+  // before children
+  std::size_t Count() const { return m_all.rects.size(); }
+  const SDL_FRect *Rects() const { return m_all.rects.data(); }
+  const node_index_t *Nodes() const { return m_all.nodes.data(); }
+
+private:
+  struct Block {
+    uint32_t offset;
+    node_index_t count;
+    // The block's rows, in TreeLayout::Part::rows
+    uint32_t first_row;
+    uint32_t num_rows;
+  };
+
+  // Some laid out rects, with the blocks they contain
+  struct Part {
+    std::vector<SDL_FRect> rects;
+    std::vector<node_index_t> nodes;
+    std::vector<RowStart> rows;
+    std::vector<std::pair<node_index_t, Block>> blocks;
+  };
+
+  bool ShouldExpand(node_index_t node, const SDL_FRect &rect) const;
+  // Lay out the children of entry e of part into a new block
+  void Expand(Part &part, std::size_t e) const;
+  // Expand every entry from 'first' on that should be, including new ones
+  void ExpandFrom(Part &part, std::size_t first) const;
+  // Move the blocks found since the last call into the lookup table
+  void AddBlocks(std::size_t offset_shift = 0, std::size_t row_shift = 0);
+  // Index of node i in the rects, or SIZE_MAX
+  std::size_t EntryOf(node_index_t i) const;
+
+private:
+  const FileTree *m_tree;
+
+  Part m_all;
+  std::unordered_map<node_index_t, Block> m_blocks;
+
+  SDL_FRect m_space;
+  SDL_FRect m_view;
+  float m_min_size;
+  // Rects left unused by Relayout
+  std::size_t m_garbage;
+};
+
+bool Overlaps(const SDL_FRect &a, const SDL_FRect &b)
 {
-  const SDL_FPoint p = {(float)x, (float)y};
+  return a.x < b.x + b.w and b.x < a.x + a.w and a.y < b.y + b.h and
+         b.y < a.y + a.h;
+}
 
-  if (tree->GetRoot().type != File::DIRECTORY) { return 0; }
+bool TreeLayout::ShouldExpand(node_index_t node, const SDL_FRect &rect) const
+{
+  return node != NO_NODE and m_tree->CountChildren(node) > 0 and
+         rect.w > 0 and rect.h > 0 and rect.w >= m_min_size and
+         rect.h >= m_min_size and Overlaps(rect, m_view);
+}
 
-  node_index_t i = tree->GetRoot().first_child;
-  node_index_t n = tree->CountChildren(0);
-  if (i >= tree->Size()) { return 0; }
+void TreeLayout::Expand(Part &part, std::size_t e) const
+{
+  const node_index_t dir = part.nodes[e];
+  const NodeRange children = m_tree->Children(dir);
+  const std::size_t offset = part.rects.size();
 
-  node_index_t tightest_rect = 0;
-  while (n > 0) {
-    if (SDL_PointInFRect(&p, &(rects[i]))) {
-      tightest_rect = i;
-      if (tree->GetFile(i).type != File::DIRECTORY) { return tightest_rect; }
+  part.rects.resize(offset + children.size());
+  for (node_index_t c : children) {
+    part.nodes.push_back(c);
+  }
+  const std::size_t first_row = part.rows.size();
+  {
+    RowLayoutManager row_man(part.rects[e], m_tree->GetFile(dir).size,
+                             m_tree->Sizes() + children.first,
+                             part.rects.data() + offset, &part.rows);
+    row_man.Add(children.size());
+  }
+  part.blocks.push_back(
+      {dir,
+       {(uint32_t)offset, children.size(), (uint32_t)first_row,
+        (uint32_t)(part.rows.size() - first_row)}});
+}
 
-      n = tree->CountChildren(i);
-      i = tree->GetFile(i).first_child;
+void TreeLayout::ExpandFrom(Part &part, std::size_t first) const
+{
+  // New blocks go on the end, so this is breadth-first
+  for (std::size_t e = first; e < part.rects.size(); ++e) {
+    if (ShouldExpand(part.nodes[e], part.rects[e])) { Expand(part, e); }
+  }
+}
 
-      if (i >= tree->Size()) { return tightest_rect; }
-    } else {
-      ++i;
-      --n;
+void TreeLayout::AddBlocks(std::size_t offset_shift, std::size_t row_shift)
+{
+  for (auto [dir, block] : m_all.blocks) {
+    block.offset += (uint32_t)offset_shift;
+    block.first_row += (uint32_t)row_shift;
+    m_blocks[dir] = block;
+  }
+  m_all.blocks.clear();
+}
+
+void TreeLayout::Build(SDL_FRect space, SDL_FRect view, float min_size,
+                       unsigned num_threads)
+{
+  PhaseTimer timer(Phase::LAYOUT);
+  m_space = space;
+  m_view = view;
+  m_min_size = min_size;
+  m_garbage = 0;
+  m_blocks.clear();
+  m_all = Part();
+  m_all.rects.push_back(space);
+  m_all.nodes.push_back(0);
+
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Go down level by level until there are enough subtrees to share between
+  // the threads, or everything is done
+  std::size_t level = 0;
+  while (level < Count() and
+         (num_threads == 1 or Count() - level < 64 * num_threads)) {
+    const std::size_t level_end = Count();
+    for (std::size_t e = level; e < level_end; ++e) {
+      if (ShouldExpand(m_all.nodes[e], m_all.rects[e])) { Expand(m_all, e); }
     }
+    level = level_end;
+  }
+  AddBlocks();
+  if (level == Count()) { return; }
+
+  // Each subtree below here only depends on its own rect, so is laid out into
+  // its own part (with the subtree's root as entry 0) and then added on
+  std::vector<std::size_t> roots;
+  for (std::size_t e = level; e < Count(); ++e) {
+    if (ShouldExpand(m_all.nodes[e], m_all.rects[e])) { roots.push_back(e); }
+  }
+  std::vector<Part> parts(roots.size());
+
+  // Biggest first, so the threads finish at about the same time
+  std::vector<std::size_t> order(roots.size());
+  for (std::size_t i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+    return m_tree->GetFile(m_all.nodes[roots[a]]).size >
+           m_tree->GetFile(m_all.nodes[roots[b]]).size;
+  });
+
+  std::atomic<std::size_t> next_part(0);
+  auto worker = [&]() {
+    for (std::size_t i; (i = next_part++) < order.size();) {
+      const std::size_t r = order[i];
+      Part &part = parts[r];
+      part.rects.push_back(m_all.rects[roots[r]]);
+      part.nodes.push_back(m_all.nodes[roots[r]]);
+      ExpandFrom(part, 0);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < num_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread &t : threads) {
+    t.join();
+  }
+
+  for (Part &part : parts) {
+    // Entry 0 is already in m_all
+    const std::size_t shift = Count() - 1;
+    const std::size_t row_shift = m_all.rows.size();
+    m_all.rects.insert(m_all.rects.end(), part.rects.begin() + 1,
+                       part.rects.end());
+    m_all.nodes.insert(m_all.nodes.end(), part.nodes.begin() + 1,
+                       part.nodes.end());
+    m_all.rows.insert(m_all.rows.end(), part.rows.begin(), part.rows.end());
+    m_all.blocks.swap(part.blocks);
+    AddBlocks(shift, row_shift);
+    part = Part();
+  }
+}
+
+bool TreeLayout::Refine(SDL_FRect view, float min_size)
+{
+  PhaseTimer timer(Phase::LAYOUT);
+  m_view = view;
+  m_min_size = min_size;
+  const std::size_t start = Count();
+
+  // Only walk through what is visible
+  std::vector<node_index_t> pending = {0};
+  while (!pending.empty()) {
+    const node_index_t dir = pending.back();
+    pending.pop_back();
+
+    auto it = m_blocks.find(dir);
+    if (it == m_blocks.end()) {
+      const std::size_t e = EntryOf(dir);
+      if (e == SIZE_MAX or !ShouldExpand(dir, m_all.rects[e])) { continue; }
+      Expand(m_all, e);
+      AddBlocks();
+      it = m_blocks.find(dir);
+    }
+
+    const Block b = it->second;
+    for (std::size_t e = b.offset; e < b.offset + b.count; ++e) {
+      const node_index_t c = m_all.nodes[e];
+      if (c != NO_NODE and m_tree->CountChildren(c) > 0 and
+          Overlaps(m_all.rects[e], m_view)) {
+        pending.push_back(c);
+      }
+    }
+  }
+  return Count() != start;
+}
+
+void TreeLayout::Relayout(node_index_t dir)
+{
+  // Forget everything below dir, the nodes may well have moved
+  std::vector<node_index_t> below = {dir};
+  while (!below.empty()) {
+    const node_index_t d = below.back();
+    below.pop_back();
+
+    auto it = m_blocks.find(d);
+    if (it == m_blocks.end()) { continue; }
+    const Block b = it->second;
+    m_blocks.erase(it);
+
+    for (std::size_t e = b.offset; e < b.offset + b.count; ++e) {
+      if (m_all.nodes[e] != NO_NODE) { below.push_back(m_all.nodes[e]); }
+      m_all.nodes[e] = NO_NODE;
+      m_all.rects[e] = {0, 0, 0, 0};
+    }
+    m_garbage += b.count;
+  }
+
+  if (m_garbage > Count() / 2) {
+    Build(m_space, m_view, m_min_size);
+    return;
+  }
+
+  PhaseTimer timer(Phase::LAYOUT);
+  const std::size_t e = EntryOf(dir);
+  if (e == SIZE_MAX or !ShouldExpand(dir, m_all.rects[e])) { return; }
+  const std::size_t first_new = Count();
+  Expand(m_all, e);
+  ExpandFrom(m_all, first_new);
+  AddBlocks();
+}
+
+std::size_t TreeLayout::EntryOf(node_index_t i) const
+{
+  if (i == 0) { return Count() ? 0 : SIZE_MAX; }
+
+  const node_index_t p = m_tree->GetFile(i).parent;
+  auto it = m_blocks.find(p);
+  if (it == m_blocks.end()) { return SIZE_MAX; }
+
+  const node_index_t k = i - m_tree->Children(p).first;
+  if (k >= it->second.count) { return SIZE_MAX; }
+  return it->second.offset + k;
+}
+
+SDL_FRect TreeLayout::GetRect(node_index_t i) const
+{
+  const std::size_t e = EntryOf(i);
+  if (e == SIZE_MAX) { return {0, 0, 0, 0}; }
+  return m_all.rects[e];
+}
+
+const SDL_FRect *TreeLayout::ChildRects(node_index_t dir) const
+{
+  auto it = m_blocks.find(dir);
+  if (it == m_blocks.end() or
+      it->second.count != (node_index_t)m_tree->CountChildren(dir)) {
+    return nullptr;
+  }
+  return m_all.rects.data() + it->second.offset;
+}
+
+node_index_t TreeLayout::ChildAt(node_index_t dir, SDL_FPoint p) const
+{
+  auto it = m_blocks.find(dir);
+  if (it == m_blocks.end() or it->second.num_rows == 0 or
+      it->second.count != (node_index_t)m_tree->CountChildren(dir)) {
+    return NULL_INDEX;
+  }
+  const Block &b = it->second;
+  const SDL_FRect *rects = m_all.rects.data() + b.offset;
+  const RowStart *rows = m_all.rows.data() + b.first_row;
+
+  // The space left before each row is nested inside the one before and
+  // shares its bottom right corner, so find the last one p is in
+  auto in_space_left = [&](const RowStart &r) {
+    return p.x >= rects[r.first].x and p.y >= rects[r.first].y;
+  };
+  if (!in_space_left(rows[0])) { return NULL_INDEX; }
+  const RowStart *row =
+      std::partition_point(rows, rows + b.num_rows, in_space_left) - 1;
+  const uint32_t row_end =
+      (row + 1 < rows + b.num_rows) ? row[1].first : b.count;
+
+  // Then the last element of the row that starts before p
+  const SDL_FRect *found =
+      std::partition_point(rects + row->first, rects + row_end,
+                           [&](const SDL_FRect &r) {
+                             return row->portrait ? r.x <= p.x : r.y <= p.y;
+                           }) -
+      1;
+  if (!SDL_PointInFRect(&p, found)) { return NULL_INDEX; }
+  return m_tree->Children(dir).first + (node_index_t)(found - rects);
+}
+
+template <typename F>
+void TreeLayout::ForEachIn(SDL_FRect area, float min_size, F &&f) const
+{
+  auto visible = [&](const SDL_FRect &r) {
+    return r.w > 0 and r.h > 0 and Overlaps(r, area);
+  };
+  auto big_enough = [&](const SDL_FRect &r) {
+    return r.w >= min_size and r.h >= min_size;
+  };
+
+  if (Count() == 0 or !visible(m_all.rects[0])) { return; }
+  f(node_index_t(0), m_all.rects[0], 0);
+
+  // (directory, depth)
+  std::vector<std::pair<node_index_t, int>> pending;
+  if (big_enough(m_all.rects[0])) { pending.emplace_back(0, 0); }
+  while (!pending.empty()) {
+    const auto [dir, depth] = pending.back();
+    pending.pop_back();
+
+    const SDL_FRect *rects = ChildRects(dir);
+    if (rects == nullptr) { continue; }
+
+    const NodeRange children = m_tree->Children(dir);
+    for (node_index_t k = 0; k < children.size(); ++k) {
+      if (!visible(rects[k])) { continue; }
+      f(children.first + k, rects[k], depth + 1);
+      if (big_enough(rects[k])) {
+        pending.emplace_back(children.first + k, depth + 1);
+      }
+    }
+  }
+}
+
+// x and y are in layout coordinates, which are fractional when zoomed in
+node_index_t FindMouseClick(const TreeLayout &layout, float x, float y)
+{
+  const SDL_FPoint p = {x, y};
+
+  node_index_t tightest_rect = 0;
+  for (;;) {
+    const node_index_t hit = layout.ChildAt(tightest_rect, p);
+    if (hit == NULL_INDEX) { return tightest_rect; }
+    tightest_rect = hit;
   }
-  return tightest_rect;
 }
@@ -1,15 +1,32 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <ctime>
 #include <filesystem>
 #include <iostream>
+#include <memory>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#ifdef __unix__
+#include <sys/stat.h>
+#endif
+
+#include "stats.h"
+
 using node_index_t = uint32_t;
 constexpr node_index_t NULL_INDEX = 0;
 
+// Offset of a name in FileTree's name arena
+using name_offset_t = uint32_t;
+
 namespace fs = std::filesystem;
 
 // TODO - get better values/make platform dependent
@@ -17,32 +34,198 @@ namespace fs = std::filesystem;
 #define SYMLINK_SIZE 64
 
 // ============ File ================
-// All we need to know about a file
+// All we need to know about a file, as it comes out of a scan
 struct File {
-  File(const fs::directory_entry &);
-  ~File() = default;
-
-  fs::path path;
-  uintmax_t size;
-  enum Type {
+  enum Type : uint8_t {
     REGULAR,
     DIRECTORY,
     SYMLINK,
     OTHER, // Anything we don't recognise gets Type == 'OTHER'
-  } type;
+    EMPTY, // A slot left behind by a removed or moved node
+    // Stands in for a directory's smallest files, with their total size,
+    // see FoldSmallFiles
+    AGGREGATE,
+    // A directory the scan was told not to open, see ScanOptions. Has no
+    // children, sorts after the directories and is never folded.
+    PRUNED,
+  };
+
+  File(const fs::directory_entry &);
+  // For scanners that have already worked out the type and size themselves
+  File(std::string _name, uintmax_t _size, Type _type)
+      : name(std::move(_name)), size(_size), type(_type) {}
+  ~File() = default;
+
+  static constexpr uint32_t NO_UID = UINT32_MAX;
+  static constexpr int64_t NO_MTIME = INT64_MIN;
+
+  // Just the filename, full paths are rebuilt from the tree when needed
+  std::string name;
+  uintmax_t size;
+  Type type;
+  // Owner and modification time (seconds since the epoch), if the scanner
+  // stat'd the file anyway
+  uint32_t uid = NO_UID;
+  int64_t mtime = NO_MTIME;
+};
+
+// How long before the scan a file was last modified
+enum class Age : uint8_t {
+  DAY,
+  WEEK,
+  MONTH,
+  HALF_YEAR,
+  YEAR,
+  THREE_YEARS,
+  OLDER,
+  UNKNOWN,
+  NUM_AGES,
+};
+
+// What FileTree keeps of a file besides its size and type, see
+// attributes.h. Extensions and owners are ids into FileTree's tables, 0 for
+// none/unknown.
+struct NodeAttributes {
+  uint16_t extension = 0;
+  uint16_t owner = 0;
+  Age age = Age::UNKNOWN;
 };
 
 // ============= FileNode =====================
 // We store the tree as a flat array, nodes all store the index of their parent.
 // Children are stored contiguously in the array, and parents store the index to
 // the first child.
-struct FileNode : File {
-  FileNode(const File &_f, node_index_t _p) : File(_f), parent(_p) {}
-
+// FileTree keeps each field in its own array, a FileNode is a copy of the
+// fields for one node.
+struct FileNode {
+  uintmax_t size;
   node_index_t parent;
   node_index_t first_child;
+  File::Type type;
 };
 
+// ============= NodeRange =====================
+// A contiguous run of node indices [first, last), e.g. the children of a
+// directory. Iterating gives the indices.
+class NodeRange {
+public:
+  class iterator {
+  public:
+    explicit iterator(node_index_t _i) : m_i(_i) {}
+    node_index_t operator*() const { return m_i; }
+    iterator &operator++() {
+      ++m_i;
+      return *this;
+    }
+    bool operator!=(const iterator &o) const { return m_i != o.m_i; }
+    bool operator==(const iterator &o) const { return m_i == o.m_i; }
+
+  private:
+    node_index_t m_i;
+  };
+
+  NodeRange(node_index_t _first, node_index_t _last)
+      : first(_first), last(_last) {}
+
+  iterator begin() const { return iterator(first); }
+  iterator end() const { return iterator(last); }
+  node_index_t size() const { return last - first; }
+  bool empty() const { return first == last; }
+
+  node_index_t first;
+  node_index_t last;
+};
+
+// ============= Column =====================
+// One of FileTree's arrays. Usually owns its elements, but can instead be a
+// read-only view of memory owned by something else (e.g. a mapped snapshot).
+// A view is copied into owned memory the first time it is modified.
+template <typename T> class Column {
+public:
+  Column() : m_data(nullptr), m_size(0), m_is_view(false) {}
+  Column(const Column &o) { *this = o; }
+  Column(Column &&) = default;
+  Column &operator=(Column &&) = default;
+  Column &operator=(const Column &o) {
+    m_owned = o.m_owned;
+    m_data = o.m_data;
+    m_size = o.m_size;
+    m_is_view = o.m_is_view;
+    if (!m_is_view) { Sync(); }
+    return *this;
+  }
+
+  const T &operator[](std::size_t i) const { return m_data[i]; }
+  // Writable reference to element i
+  T &Mut(std::size_t i) {
+    if (m_is_view) { Own(); }
+    return m_owned[i];
+  }
+
+  const T *data() const { return m_data; }
+  std::size_t size() const { return m_size; }
+  // Bytes we own, not counting anything we are a view of
+  std::size_t capacity() const { return m_owned.capacity(); }
+
+  void push_back(const T &v) {
+    if (m_is_view) { Own(); }
+    m_owned.push_back(v);
+    Sync();
+  }
+  void append(const T *first, const T *last) {
+    if (m_is_view) { Own(); }
+    m_owned.insert(m_owned.end(), first, last);
+    Sync();
+  }
+  void shrink_to_fit() {
+    m_owned.shrink_to_fit();
+    if (!m_is_view) { Sync(); }
+  }
+
+  void View(const T *data, std::size_t n) {
+    m_owned = {};
+    m_data = data;
+    m_size = n;
+    m_is_view = true;
+  }
+
+private:
+  void Own() {
+    m_owned.assign(m_data, m_data + m_size);
+    m_is_view = false;
+    Sync();
+  }
+  void Sync() {
+    m_data = m_owned.data();
+    m_size = m_owned.size();
+  }
+
+private:
+  std::vector<T> m_owned;
+  const T *m_data;
+  std::size_t m_size;
+  bool m_is_view;
+};
+
+// ============= DirListing =====================
+// The scanned contents of a single directory, produced by a scanner before it
+// is added to a FileTree. Children are already sorted with FileOrder, and
+// 'subdirs' holds one listing per DIRECTORY child, in the same order.
+// The scanner sets 'ready' once children and subdirs are filled in, after
+// which the listing can be read from another thread.
+struct DirListing {
+  explicit DirListing(const fs::path &_p) : path(_p) {}
+
+  fs::path path;
+  // Levels below the root of the scan
+  unsigned depth = 0;
+  std::vector<File> children;
+  std::vector<std::unique_ptr<DirListing>> subdirs;
+  std::atomic<bool> ready{false};
+};
+
+struct TreeDiff;
+
 /* ============== FileTree =====================
  * A (flat)tree of files/directories.
  * To build the tree we create an array of nodes, initially just containing
@@ -58,144 +241,769 @@ struct FileNode : File {
  *                   dir1    file1
  *                    /
  *                 file2
+ *
+ * Nodes are stored as a struct-of-arrays (30 bytes per node) and names live
+ * in a single arena of null-terminated basenames. Root's name is the full
+ * path that was scanned. Directories also store their number of children so
+ * child ranges are available without scanning.
+ *
+ * Files also keep their extension and owner, as ids into small tables of
+ * the distinct ones seen, and how old they are, see NodeAttributes.
+ *
+ * Directory sizes are kept up to date as the tree grows, each directory is the
+ * sum of its children plus DIR_SIZE.
+ *
+ * A grown tree can still be modified (see watcher.h). Removed nodes are left
+ * as EMPTY slots, and a directory that needs more room than its child range
+ * has moves everything below it to the back of the array, so a parent is
+ * always stored before its children. Anything walking the array in index
+ * order should skip EMPTY nodes. Compact gets rid of them again, along with
+ * the names of removed nodes.
  */
 
 class FileTree {
 public:
   FileTree(const fs::path &root);
+  // A tree whose root isn't read from disk, to grow from listings made up in
+  // memory (see synthetic.h)
+  explicit FileTree(const File &root);
+  FileTree(FileTree &&) = default;
+  FileTree &operator=(FileTree &&) = default;
   ~FileTree() {}
 
+  friend void SaveSnapshot(const FileTree &, const fs::path &);
+  friend FileTree LoadSnapshot(const fs::path &);
+  friend TreeDiff DiffTrees(const FileTree &, const FileTree &);
+
   // Expand the tree fully
   void Grow();
 
-  // After the tree is fully expanded, we can calculate directory sizes as the
-  // sum of their children
-  void CalcSizes();
+  // Expand the tree fully from a completed scan of root, see scanner.h
+  void Grow(DirListing &root);
+
+  // Expand the tree from a scan of root that is still running. Nothing is
+  // added until GrowReady is called.
+  void GrowFrom(DirListing &root);
+  // Add the listings that the scan has finished, in breadth-first order,
+  // stopping after max_nodes nodes. Returns the number of nodes added.
+  std::size_t GrowReady(std::size_t max_nodes = SIZE_MAX);
+
+  int CountChildren(node_index_t directory) const {
+    return (int)m_child_count[directory];
+  }
+  // Indices of the children of directory, empty for anything else
+  NodeRange Children(node_index_t directory) const {
+    const node_index_t c0 = m_first_child[directory];
+    return {c0, c0 + m_child_count[directory]};
+  }
+  FileNode GetRoot() const { return GetFile(0); }
+  FileNode GetFile(node_index_t i) const {
+    return {m_size[i], m_parent[i], m_first_child[i], m_type[i]};
+  }
+  // Every node's size, indexed by node. Children's sizes are contiguous.
+  const uintmax_t *Sizes() const { return m_size.data(); }
+  const File::Type *Types() const { return m_type.data(); }
+
+  NodeAttributes GetAttributes(node_index_t i) const {
+    return {m_extension[i], m_owner[i], m_age[i]};
+  }
+  // Every node's attributes, indexed by node
+  const uint16_t *ExtensionIds() const { return m_extension.data(); }
+  const uint16_t *OwnerIds() const { return m_owner.data(); }
+  const Age *Ages() const { return m_age.data(); }
+  // Lower-cased, without the dot, "" for id 0
+  const std::string &ExtensionName(uint16_t id) const {
+    return m_extensions[id];
+  }
+  std::size_t NumExtensions() const { return m_extensions.size(); }
+  // File::NO_UID for id 0
+  uint32_t OwnerUid(uint16_t id) const { return m_owners[id]; }
+  std::size_t NumOwners() const { return m_owners.size(); }
+  const char *GetName(node_index_t i) const {
+    return m_names.data() + m_name[i];
+  }
+  // Every node's offset into Names(). Siblings' names are next to each other,
+  // in order, unless the tree has been changed since it was grown.
+  const name_offset_t *NameOffsets() const { return m_name.data(); }
+  const char *Names() const { return m_names.data(); }
+  // Bytes in Names()
+  std::size_t NamesSize() const { return m_names.size(); }
+  // Rebuilds the full path by walking up the parents
+  fs::path GetPath(node_index_t i) const;
+
+  std::size_t Size() const { return (node_index_t)m_parent.size(); }
+  // Number of EMPTY nodes
+  std::size_t EmptySlots() const { return m_empty; }
+  // Are over half the nodes EMPTY, or have the names doubled since the tree
+  // finished growing or was last compacted. Compacting then keeps a tree that
+  // keeps changing within about twice the memory of what it holds.
+  bool NeedsCompacting() const {
+    return m_empty > Size() / 2 or m_names.size() > 2 * m_compacted_names;
+  }
+  bool IsFullyGrown() const {
+    return m_grow_index >= Size() and m_listings.empty();
+  }
 
-  int CountChildren(node_index_t directory) const;
-  const FileNode &GetRoot() const { return m_nodes[0]; }
-  const FileNode &GetFile(node_index_t i) const { return m_nodes[i]; }
-  std::size_t Size() const { return (node_index_t)m_nodes.size(); }
-  bool IsFullyGrown() const { return m_grow_index < m_nodes.size(); }
+  // Bytes used to store the nodes and their names
+  std::size_t MemoryUsage() const;
+
+  // The child of dir called name, or NULL_INDEX
+  node_index_t FindChild(node_index_t dir, const char *name) const;
+
+  // Change the size of a node, updating its ancestors
+  void Resize(node_index_t i, uintmax_t size);
+  // Remove a node and everything below it, leaving EMPTY slots behind
+  void Remove(node_index_t i);
+  // Add f as a child of dir and return its index. If dir's child range is
+  // full, everything below dir is moved to the back of the array and the
+  // (old, new) index of each moved directory is appended to 'moved'. The
+  // tree must be fully grown, and still is afterwards.
+  node_index_t
+  Insert(node_index_t dir, const File &f,
+         std::vector<std::pair<node_index_t, node_index_t>> *moved = nullptr);
+  // Replace everything below dir with a finished scan of it, e.g. from
+  // ParallelScanner::Scan. The old nodes are left as EMPTY slots and the new
+  // ones added to the back of the array, so this takes time in proportion to
+  // the old and new subtrees, not the whole tree.
+  void Replace(node_index_t dir, DirListing &listing);
+  // Rebuild a fully grown tree without its EMPTY slots and unused names,
+  // keeping the order of every directory's children. Returns each old
+  // index's new index, NULL_INDEX for the EMPTY ones (the root stays at 0).
+  std::vector<node_index_t> Compact();
 
 private:
+  // An empty tree, for LoadSnapshot to fill in
+  FileTree() : m_scan_time(std::time(nullptr)), m_grow_index(0) {}
+
   // Expand the next directory
   void GrowNext();
+  // Add ready listings from m_listings, see GrowReady
+  std::size_t AddListings(std::size_t max_nodes);
 
   // Move m_grow_index to the next directory
   void SkipToNextDir();
 
+  // Release spare capacity once the tree has stopped growing
+  void ShrinkToFit();
+
+  void AddNode(const File &f, node_index_t parent);
+  // Append a name to the arena, returning its offset
+  name_offset_t AddName(const char *name, std::size_t length);
+  void AddNode(uintmax_t size, node_index_t parent, name_offset_t name,
+               File::Type type, NodeAttributes attributes = {});
+  // The attributes to keep for f, adding to the tables if need be
+  NodeAttributes MakeAttributes(const File &f);
+  uint16_t ExtensionId(const std::string &name);
+  // The id of an extension that is already lower-cased
+  uint16_t InternExtension(std::string ext);
+  uint16_t OwnerId(uint32_t uid);
+  // Make a node EMPTY without touching its ancestors
+  void Clear(node_index_t i);
+  // Move everything below dir to the back of the array, giving dir 'slack'
+  // EMPTY children to grow into
+  void Relocate(node_index_t dir, node_index_t slack,
+                std::vector<std::pair<node_index_t, node_index_t>> *moved);
+  // Append sorted children of dir to the back of the array, and add their
+  // sizes to dir and its ancestors
+  void AddChildren(node_index_t dir, const std::vector<File> &children);
+
 private:
-  std::vector<FileNode> m_nodes;
+  Column<uintmax_t> m_size;
+  Column<node_index_t> m_parent;
+  Column<node_index_t> m_first_child;
+  Column<node_index_t> m_child_count;
+  Column<name_offset_t> m_name;
+  Column<File::Type> m_type;
+
+  // Every node's name, null-terminated
+  Column<char> m_names;
+
+  Column<uint16_t> m_extension;
+  Column<uint16_t> m_owner;
+  Column<Age> m_age;
+  // Ids are indices, id 0 is none/unknown. Ids run out at UINT16_MAX, after
+  // which new extensions and owners get 0.
+  std::vector<std::string> m_extensions = {""};
+  std::unordered_map<std::string, uint16_t> m_extension_ids;
+  std::vector<uint32_t> m_owners = {File::NO_UID};
+  std::unordered_map<uint32_t, uint16_t> m_owner_ids;
+  // Ages are relative to this
+  std::time_t m_scan_time;
+
+  // Keeps alive whatever the columns are a view of, see snapshot.h
+  std::shared_ptr<const void> m_backing;
+
   // Index of the next node that needs to be expanded
   node_index_t m_grow_index;
+
+  // See EmptySlots and NeedsCompacting
+  std::size_t m_empty = 0;
+  std::size_t m_compacted_names = 0;
+
+  // Directories waiting for their listing to be added, see GrowFrom
+  std::queue<std::pair<node_index_t, DirListing *>> m_listings;
 };
 
-File::File(const fs::directory_entry &_f) {
+File::File(const fs::directory_entry &_f)
+    : name(_f.path().filename().string()) {
   // fs::status on a symlink returns the linked type e.g. 'directory', whereas
   // fs::symlink_status returns a specific type 'symlink'
   switch (_f.symlink_status().type()) {
 
   case fs::file_type::directory: {
-    path = _f.path();
     size = DIR_SIZE;
     type = DIRECTORY;
   } break;
 
   case fs::file_type::regular: {
-    path = _f.path().filename();
-    size = _f.file_size();
     type = REGULAR;
+#ifdef __unix__
+    // file_size would stat anyway, this way we get the owner and age too
+    struct stat st;
+    if (lstat(_f.path().c_str(), &st) == 0) {
+      size = (uintmax_t)st.st_size;
+      uid = (uint32_t)st.st_uid;
+      mtime = (int64_t)st.st_mtime;
+      break;
+    }
+#endif
+    size = _f.file_size();
   } break;
 
   case fs::file_type::symlink: {
-    path = _f.path().filename();
     size = SYMLINK_SIZE;
     type = SYMLINK;
   } break;
 
   default: {
-    path = _f.path().filename();
     type = OTHER;
     size = 0;
-    std::clog << "Warning, unrecognised file: " << path << '\n';
+    std::clog << "Warning, unrecognised file: " << _f.path() << '\n';
   } break;
   }
 }
 
-FileTree::FileTree(const fs::path &_path) : m_grow_index(0) {
-  m_nodes.emplace_back(fs::directory_entry(_path), NULL_INDEX);
+FileTree::FileTree(const fs::path &_path)
+    : m_scan_time(std::time(nullptr)), m_grow_index(0) {
+  File root{fs::directory_entry(_path)};
+  root.name = _path.string();
+  AddNode(root, NULL_INDEX);
+}
+
+FileTree::FileTree(const File &root)
+    : m_scan_time(std::time(nullptr)), m_grow_index(0) {
+  AddNode(root, NULL_INDEX);
 }
 
-bool FileOrder(const FileNode &a, const FileNode &b) {
-  if (a.type == File::DIRECTORY) {
-    if (b.type == File::DIRECTORY) {
-      return a.path.filename() > b.path.filename();
+bool FileOrder(const File &a, const File &b) {
+  // Directories, then pruned directories, each by name
+  for (File::Type t : {File::DIRECTORY, File::PRUNED}) {
+    if (a.type == t) {
+      if (b.type == t) { return a.name > b.name; }
+      return true;
     }
-    return true;
+    if (b.type == t) { return false; }
   }
-  if (b.type == File::DIRECTORY) { return false; }
 
-  return a.size > b.size;
+  // Ties go by name so a directory always sorts the same way, which lets two
+  // scans of it be compared in order, see diff.h
+  if (a.size != b.size) { return a.size > b.size; }
+  return a.name > b.name;
 }
 
-void FileTree::GrowNext() {
-  SkipToNextDir();
+// Replace all but the 'keep' largest files in children, and any smaller than
+// min_size, with a single AGGREGATE node of their total size. Directories,
+// pruned or not, and AGGREGATE nodes are always kept. Children must be sorted
+// with FileOrder and stay sorted. Returns the number of files folded.
+std::size_t FoldSmallFiles(std::vector<File> &children, std::size_t keep,
+                           uintmax_t min_size) {
+  // Directories sort to the front, then files largest first
+  auto first_file = std::find_if(
+      children.begin(), children.end(), [](const File &f) {
+        return f.type != File::DIRECTORY and f.type != File::PRUNED;
+      });
+  auto big_end = std::partition_point(
+      first_file, children.end(),
+      [&](const File &f) { return f.size >= min_size; });
+  if ((std::size_t)(big_end - first_file) > keep) {
+    big_end = first_file + keep;
+  }
+
+  // An earlier fold already stands for many files, so is kept as it is
+  auto is_aggregate = [](const File &f) { return f.type == File::AGGREGATE; };
+  const std::size_t folded =
+      (children.end() - big_end) -
+      std::count_if(big_end, children.end(), is_aggregate);
+  // Folding a single file into a node of its own saves nothing
+  if (folded < 2) { return 0; }
+
+  uintmax_t total = 0;
+  std::vector<File> kept;
+  for (auto it = big_end; it != children.end(); ++it) {
+    if (is_aggregate(*it)) {
+      kept.push_back(std::move(*it));
+    } else {
+      total += it->size;
+    }
+  }
+  children.erase(big_end, children.end());
+
+  kept.emplace_back(std::to_string(folded) + " small files", total,
+                    File::AGGREGATE);
+  for (File &f : kept) {
+    children.insert(
+        std::upper_bound(children.begin(), children.end(), f, FileOrder),
+        std::move(f));
+  }
+  Stats::Count(Counter::FILES_FOLDED, folded);
+  return folded;
+}
 
-  if (m_grow_index >= m_nodes.size()) { return; }
+// Does name match a glob pattern of '*' and '?', optionally ignoring ASCII
+// case
+bool GlobMatch(const char *pattern, const char *name,
+               bool ignore_case = false) {
+  auto lower = [&](char c) {
+    return (ignore_case and c >= 'A' and c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+  };
+  // Backtracks to just after the last '*' on a mismatch
+  const char *star = nullptr, *resume = nullptr;
+  while (*name) {
+    if (*pattern == '*') {
+      star = pattern++;
+      resume = name;
+    } else if (*pattern == '?' or
+               (*pattern and lower(*pattern) == lower(*name))) {
+      ++pattern;
+      ++name;
+    } else if (star) {
+      pattern = star + 1;
+      name = ++resume;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*') {
+    ++pattern;
+  }
+  return *pattern == '\0';
+}
 
-  FileNode &f = m_nodes[m_grow_index];
-  f.first_child = NULL_INDEX;
+void FileTree::AddNode(const File &f, node_index_t parent) {
+  AddNode(f.size, parent, AddName(f.name.c_str(), f.name.size()), f.type,
+          MakeAttributes(f));
+}
+
+name_offset_t FileTree::AddName(const char *name, std::size_t length) {
+  const std::size_t offset = m_names.size();
+  if (offset + length + 1 > UINT32_MAX) {
+    throw std::length_error("FileTree name arena is full");
+  }
+  m_names.append(name, name + length + 1);
+  return (name_offset_t)offset;
+}
+
+void FileTree::AddNode(uintmax_t size, node_index_t parent, name_offset_t name,
+                       File::Type type, NodeAttributes attributes) {
+  m_size.push_back(size);
+  m_parent.push_back(parent);
+  m_first_child.push_back(NULL_INDEX);
+  m_child_count.push_back(0);
+  m_name.push_back(name);
+  m_type.push_back(type);
+  m_extension.push_back(attributes.extension);
+  m_owner.push_back(attributes.owner);
+  m_age.push_back(attributes.age);
+  if (type == File::EMPTY) { ++m_empty; }
+}
 
-  const node_index_t child_slot = m_nodes.size();
-  for (const fs::directory_entry &c : fs::directory_iterator(f.path)) {
-    m_nodes.emplace_back(c, m_grow_index);
+NodeAttributes FileTree::MakeAttributes(const File &f) {
+  NodeAttributes a;
+  // Only files have extensions, "foo.d" is just a directory
+  if (f.type == File::REGULAR or f.type == File::SYMLINK) {
+    a.extension = ExtensionId(f.name);
+  }
+  if (f.uid != File::NO_UID) { a.owner = OwnerId(f.uid); }
+  if (f.mtime != File::NO_MTIME) {
+    // Upper limit of each Age, in days
+    static constexpr int64_t limits[] = {1, 7, 31, 183, 365, 3 * 365};
+    const int64_t days = ((int64_t)m_scan_time - f.mtime) / (24 * 60 * 60);
+    a.age = Age::OLDER;
+    for (int k = 0; k < (int)Age::OLDER; ++k) {
+      if (days < limits[k]) {
+        a.age = (Age)k;
+        break;
+      }
+    }
+  }
+  return a;
+}
 
-    // Only need to do this once
-    m_nodes[m_grow_index].first_child = child_slot;
+uint16_t FileTree::ExtensionId(const std::string &name) {
+  // Not the whole of a dotfile's name, and nothing long enough that it is
+  // unlikely to be an extension
+  const std::size_t dot = name.rfind('.');
+  if (dot == std::string::npos or dot == 0 or name.size() - dot > 16) {
+    return 0;
+  }
+  std::string ext = name.substr(dot + 1);
+  if (ext.empty()) { return 0; }
+  for (char &c : ext) {
+    if (c >= 'A' and c <= 'Z') { c = (char)(c - 'A' + 'a'); }
   }
-  std::sort(m_nodes.begin() + child_slot, m_nodes.end(), FileOrder);
+  return InternExtension(std::move(ext));
+}
+
+uint16_t FileTree::InternExtension(std::string ext) {
+  if (ext.empty()) { return 0; }
+  auto it = m_extension_ids.find(ext);
+  if (it != m_extension_ids.end()) { return it->second; }
+  if (m_extensions.size() > UINT16_MAX) { return 0; }
+  const uint16_t id = (uint16_t)m_extensions.size();
+  m_extensions.push_back(ext);
+  m_extension_ids.emplace(std::move(ext), id);
+  return id;
+}
+
+uint16_t FileTree::OwnerId(uint32_t uid) {
+  auto it = m_owner_ids.find(uid);
+  if (it != m_owner_ids.end()) { return it->second; }
+  if (m_owners.size() > UINT16_MAX) { return 0; }
+  const uint16_t id = (uint16_t)m_owners.size();
+  m_owners.push_back(uid);
+  m_owner_ids.emplace(uid, id);
+  return id;
+}
+
+void FileTree::AddChildren(node_index_t dir,
+                           const std::vector<File> &children) {
+  if (children.empty()) { return; }
+  PhaseTimer timer(Phase::GROW);
+
+  m_first_child.Mut(dir) = (node_index_t)Size();
+  m_child_count.Mut(dir) = (node_index_t)children.size();
+
+  uintmax_t total = 0;
+  for (const File &c : children) {
+    AddNode(c, dir);
+    total += c.size;
+  }
+
+  for (node_index_t a = dir;; a = m_parent[a]) {
+    m_size.Mut(a) += total;
+    if (a == 0) { break; }
+  }
+}
+
+void FileTree::GrowNext() {
+  SkipToNextDir();
+
+  if (m_grow_index >= Size()) { return; }
+
+  std::vector<File> children;
+  {
+    PhaseTimer timer(Phase::READ_DIR);
+    Stats::Count(Counter::DIRS_READ);
+    for (const fs::directory_entry &c :
+         fs::directory_iterator(GetPath(m_grow_index))) {
+      children.emplace_back(c);
+    }
+  }
+  {
+    PhaseTimer timer(Phase::SORT);
+    std::sort(children.begin(), children.end(), FileOrder);
+  }
+  AddChildren(m_grow_index, children);
 
   ++m_grow_index;
 }
 
 void FileTree::Grow() {
-  std::cout << '\n';
-  while (m_grow_index < m_nodes.size()) {
+  // To stderr, like the scanner's progress
+  std::clog << '\n';
+  while (m_grow_index < Size()) {
     GrowNext();
     if (Size() % 64 == 0) {
-      std::cout << "\x1B[2K\r" << Size() << " files" << std::flush;
+      std::clog << "\x1B[2K\r" << Size() << " files" << std::flush;
     }
   }
-  std::cout << "\x1B[2K\r\n";
+  std::clog << "\x1B[2K\r\n";
+  ShrinkToFit();
+}
+
+void FileTree::Grow(DirListing &root) {
+  GrowFrom(root);
+  GrowReady();
+  assert(IsFullyGrown());
+}
+
+void FileTree::GrowFrom(DirListing &root) { m_listings.emplace(0, &root); }
+
+std::size_t FileTree::GrowReady(std::size_t max_nodes) {
+  const bool growing = !m_listings.empty();
+  const std::size_t added = AddListings(max_nodes);
+  if (m_listings.empty()) {
+    m_grow_index = (node_index_t)Size();
+    // Just the once, as the last listing is added
+    if (growing) { ShrinkToFit(); }
+  }
+  return added;
+}
+
+std::size_t FileTree::AddListings(std::size_t max_nodes) {
+  // Listings are added in the same breadth-first order GrowNext would visit
+  // them in, so the resulting layout is identical to a sequential Grow()
+  const std::size_t start_size = Size();
+  while (!m_listings.empty() and Size() - start_size < max_nodes) {
+    auto [dir, listing] = m_listings.front();
+    if (!listing->ready.load(std::memory_order_acquire)) { break; }
+    m_listings.pop();
+
+    const node_index_t child_slot = (node_index_t)Size();
+    AddChildren(dir, listing->children);
+    for (std::size_t i = 0; i < listing->subdirs.size(); ++i) {
+      // Directories sort to the front of children
+      m_listings.emplace(child_slot + i, listing->subdirs[i].get());
+    }
+
+    // Free as we go, the listings roughly double peak memory otherwise
+    listing->children = {};
+  }
+  return Size() - start_size;
+}
+
+void FileTree::ShrinkToFit() {
+  m_compacted_names = m_names.size();
+  m_size.shrink_to_fit();
+  m_parent.shrink_to_fit();
+  m_first_child.shrink_to_fit();
+  m_child_count.shrink_to_fit();
+  m_name.shrink_to_fit();
+  m_type.shrink_to_fit();
+  m_names.shrink_to_fit();
+  m_extension.shrink_to_fit();
+  m_owner.shrink_to_fit();
+  m_age.shrink_to_fit();
 }
 
 void FileTree::SkipToNextDir() {
-  while (m_grow_index < m_nodes.size() and
-         m_nodes[m_grow_index].type != File::DIRECTORY) {
+  while (m_grow_index < Size() and m_type[m_grow_index] != File::DIRECTORY) {
     ++m_grow_index;
   }
 }
 
-void FileTree::CalcSizes() {
-  if (m_nodes.size() == 0) { return; }
+fs::path FileTree::GetPath(node_index_t i) const {
+  std::vector<node_index_t> ancestors;
+  for (; i != NULL_INDEX; i = m_parent[i]) {
+    ancestors.push_back(i);
+  }
+
+  fs::path p = GetName(0);
+  for (auto it = ancestors.rbegin(); it != ancestors.rend(); ++it) {
+    p /= GetName(*it);
+  }
+  return p;
+}
+
+std::size_t FileTree::MemoryUsage() const {
+  return m_size.capacity() * sizeof(uintmax_t) +
+         m_parent.capacity() * sizeof(node_index_t) +
+         m_first_child.capacity() * sizeof(node_index_t) +
+         m_child_count.capacity() * sizeof(node_index_t) +
+         m_name.capacity() * sizeof(name_offset_t) +
+         m_type.capacity() * sizeof(File::Type) + m_names.capacity() +
+         m_extension.capacity() * sizeof(uint16_t) +
+         m_owner.capacity() * sizeof(uint16_t) +
+         m_age.capacity() * sizeof(Age);
+}
+
+node_index_t FileTree::FindChild(node_index_t dir, const char *name) const {
+  for (node_index_t c : Children(dir)) {
+    if (m_type[c] != File::EMPTY and std::strcmp(GetName(c), name) == 0) {
+      return c;
+    }
+  }
+  return NULL_INDEX;
+}
+
+void FileTree::Resize(node_index_t i, uintmax_t size) {
+  // Unsigned wrap-around makes this work for shrinking too
+  const uintmax_t delta = size - m_size[i];
+  for (node_index_t a = i;; a = m_parent[a]) {
+    m_size.Mut(a) += delta;
+    if (a == 0) { break; }
+  }
+}
+
+void FileTree::Remove(node_index_t i) {
+  assert(i != 0);
+  Resize(i, 0);
+
+  std::vector<node_index_t> below = {i};
+  while (!below.empty()) {
+    const node_index_t n = below.back();
+    below.pop_back();
+    for (node_index_t c : Children(n)) {
+      below.push_back(c);
+    }
+    Clear(n);
+  }
+}
+
+void FileTree::Clear(node_index_t i) {
+  if (m_type[i] != File::EMPTY) { ++m_empty; }
+  m_size.Mut(i) = 0;
+  m_type.Mut(i) = File::EMPTY;
+  m_first_child.Mut(i) = NULL_INDEX;
+  m_child_count.Mut(i) = 0;
+}
+
+node_index_t
+FileTree::Insert(node_index_t dir, const File &f,
+                 std::vector<std::pair<node_index_t, node_index_t>> *moved) {
+  assert(IsFullyGrown() and m_type[dir] == File::DIRECTORY);
 
-  for (node_index_t i = m_nodes.size() - 1; i > 0; --i) {
-    const FileNode &child = m_nodes[i];
-    m_nodes[child.parent].size += child.size;
+  // Reuse a slot left by a removed file if there is one
+  auto find_slot = [&]() {
+    for (node_index_t c : Children(dir)) {
+      if (m_type[c] == File::EMPTY) { return c; }
+    }
+    return NULL_INDEX;
+  };
+
+  node_index_t slot = find_slot();
+  if (slot == NULL_INDEX) {
+    const NodeRange r = Children(dir);
+    if (r.empty() or r.last == Size()) {
+      // Our range is at the back of the array, so can just grow
+      if (r.empty()) { m_first_child.Mut(dir) = (node_index_t)Size(); }
+      AddNode(0, dir, 0, File::EMPTY);
+      ++m_child_count.Mut(dir);
+    } else {
+      // Leave some room so a directory that is filling up doesn't move on
+      // every new file
+      Relocate(dir, r.size() / 4 + 4, moved);
+    }
+    slot = find_slot();
   }
+
+  m_name.Mut(slot) = AddName(f.name.c_str(), f.name.size());
+  m_type.Mut(slot) = f.type;
+  --m_empty;
+  const NodeAttributes a = MakeAttributes(f);
+  m_extension.Mut(slot) = a.extension;
+  m_owner.Mut(slot) = a.owner;
+  m_age.Mut(slot) = a.age;
+  m_first_child.Mut(slot) = NULL_INDEX;
+  m_child_count.Mut(slot) = 0;
+  Resize(slot, f.size);
+  // Anything added at the back is already complete, not waiting to be grown
+  m_grow_index = (node_index_t)Size();
+  return slot;
 }
 
-int FileTree::CountChildren(node_index_t directory) const {
-  if (m_nodes[directory].type != File::DIRECTORY) { return 0; }
-  if (m_nodes[directory].first_child == NULL_INDEX) { return 0; }
+void FileTree::Relocate(
+    node_index_t dir, node_index_t slack,
+    std::vector<std::pair<node_index_t, node_index_t>> *moved) {
+  // Copy breadth-first, so parents still come before children
+  std::queue<std::pair<node_index_t, node_index_t>> pending;
+  pending.emplace(dir, dir);
+
+  while (!pending.empty()) {
+    auto [from, to] = pending.front();
+    pending.pop();
+
+    const NodeRange r = Children(from);
+    if (from != to) { Clear(from); }
+
+    const node_index_t first = (node_index_t)Size();
+    for (node_index_t c : r) {
+      const node_index_t now = (node_index_t)Size();
+      AddNode(m_size[c], to, m_name[c], m_type[c], GetAttributes(c));
+      if (m_type[c] == File::DIRECTORY) {
+        // Cleared once its own children have been copied
+        pending.emplace(c, now);
+        if (moved) { moved->emplace_back(c, now); }
+      } else {
+        Clear(c);
+      }
+    }
+    node_index_t count = r.size();
+    if (from == dir) {
+      for (node_index_t i = 0; i < slack; ++i) {
+        AddNode(0, to, 0, File::EMPTY);
+      }
+      count += slack;
+    }
 
-  node_index_t start, end;
-  start = m_nodes[directory].first_child;
-  end = start + 1;
+    m_first_child.Mut(to) = count ? first : NULL_INDEX;
+    m_child_count.Mut(to) = count;
+  }
+}
+
+void FileTree::Replace(node_index_t dir, DirListing &listing) {
+  assert(IsFullyGrown() and m_type[dir] == File::DIRECTORY);
+
+  // One size change up the parents for the whole subtree, rather than one
+  // per node like Remove
+  Resize(dir, DIR_SIZE);
+  std::vector<node_index_t> below;
+  for (node_index_t c : Children(dir)) {
+    below.push_back(c);
+  }
+  while (!below.empty()) {
+    const node_index_t n = below.back();
+    below.pop_back();
+    for (node_index_t c : Children(n)) {
+      below.push_back(c);
+    }
+    Clear(n);
+  }
+  m_first_child.Mut(dir) = NULL_INDEX;
+  m_child_count.Mut(dir) = 0;
+
+  m_listings.emplace(dir, &listing);
+  AddListings(SIZE_MAX);
+  assert(m_listings.empty());
+  // Not ShrinkToFit, which would copy the whole tree
+  m_grow_index = (node_index_t)Size();
+}
 
-  while (end < m_nodes.size() and m_nodes[end].parent == directory) {
-    ++end;
+std::vector<node_index_t> FileTree::Compact() {
+  assert(IsFullyGrown());
+  std::vector<node_index_t> new_index(Size(), NULL_INDEX);
+
+  FileTree compact;
+  compact.m_scan_time = m_scan_time;
+  compact.AddNode(m_size[0], NULL_INDEX,
+                  compact.AddName(GetName(0), std::strlen(GetName(0))),
+                  m_type[0], GetAttributes(0));
+  new_index[0] = 0;
+
+  // Breadth-first like Grow, old indices in their new order
+  std::vector<node_index_t> order = {0};
+  for (node_index_t n = 0; n < order.size(); ++n) {
+    const node_index_t first = (node_index_t)compact.Size();
+    for (node_index_t c : Children(order[n])) {
+      if (m_type[c] == File::EMPTY) { continue; }
+      new_index[c] = (node_index_t)compact.Size();
+      order.push_back(c);
+      compact.AddNode(m_size[c], n,
+                      compact.AddName(GetName(c), std::strlen(GetName(c))),
+                      m_type[c], GetAttributes(c));
+    }
+    const node_index_t count = (node_index_t)compact.Size() - first;
+    compact.m_first_child.Mut(n) = count ? first : NULL_INDEX;
+    compact.m_child_count.Mut(n) = count;
   }
-  return end - start;
+
+  // Attribute ids are unchanged
+  compact.m_extensions = std::move(m_extensions);
+  compact.m_extension_ids = std::move(m_extension_ids);
+  compact.m_owners = std::move(m_owners);
+  compact.m_owner_ids = std::move(m_owner_ids);
+  compact.m_grow_index = (node_index_t)compact.Size();
+  compact.ShrinkToFit();
+  *this = std::move(compact);
+  return new_index;
 }
@@ -1,35 +1,206 @@
 #include <cassert>
 
-#include "SDL.h"
 #include "debug.h"
-#include "filemap.h"
+#include "diff.h"
 #include "filetree.h"
+#include "report.h"
+#include "scanner.h"
+#include "snapshot.h"
+
+// The headless build has no map, only reports, and doesn't need SDL or ImGui
+#ifndef FILEMAP_HEADLESS
+#include "SDL.h"
+#include "filemap.h"
 #include "window.h"
+#endif
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
 
 int main(int argv, char **args) {
   namespace fs = std::filesystem;
 
-  if (argv != 2) {
-    std::cout << "Usage: filemap [directory]" << '\n';
+  ScanOptions options;
+  const char *dir = nullptr;
+  const char *save_path = nullptr;
+  const char *diff_path = nullptr;
+  bool watch = false;
+  bool stats = false;
+  float min_pixels = 1;
+#ifdef FILEMAP_HEADLESS
+  bool report = true;
+#else
+  bool report = false;
+#endif
+  ReportOptions report_options;
+  for (int i = 1; i < argv; ++i) {
+    if (std::strcmp(args[i], "-j") == 0 and i + 1 < argv) {
+      options.num_threads = (unsigned)std::strtoul(args[++i], nullptr, 10);
+    } else if (std::strcmp(args[i], "--save") == 0 and i + 1 < argv) {
+      save_path = args[++i];
+    } else if (std::strcmp(args[i], "--diff") == 0 and i + 1 < argv) {
+      diff_path = args[++i];
+    } else if (std::strcmp(args[i], "--min-pixels") == 0 and i + 1 < argv) {
+      min_pixels = std::strtof(args[++i], nullptr);
+    } else if (std::strcmp(args[i], "--min-size") == 0 and i + 1 < argv) {
+      options.min_file_size = std::strtoull(args[++i], nullptr, 10);
+    } else if (std::strcmp(args[i], "--max-nodes") == 0 and i + 1 < argv) {
+      options.max_nodes = std::strtoull(args[++i], nullptr, 10);
+    } else if (std::strcmp(args[i], "--exclude") == 0 and i + 1 < argv) {
+      options.exclude.push_back(args[++i]);
+    } else if (std::strcmp(args[i], "--include") == 0 and i + 1 < argv) {
+      options.include.push_back(args[++i]);
+    } else if (std::strcmp(args[i], "--max-depth") == 0 and i + 1 < argv) {
+      options.max_depth = (unsigned)std::strtoul(args[++i], nullptr, 10);
+    } else if (std::strcmp(args[i], "--one-file-system") == 0) {
+      options.one_file_system = true;
+    } else if (std::strcmp(args[i], "--report") == 0 and i + 1 < argv) {
+      report = true;
+      const char *format = args[++i];
+      if (std::strcmp(format, "json") == 0) {
+        report_options.format = ReportFormat::JSON;
+      } else if (std::strcmp(format, "csv") == 0) {
+        report_options.format = ReportFormat::CSV;
+      } else {
+        report_options.format = ReportFormat::TEXT;
+      }
+    } else if (std::strcmp(args[i], "--top") == 0 and i + 1 < argv) {
+      report_options.top = std::strtoul(args[++i], nullptr, 10);
+    } else if (std::strcmp(args[i], "--stats") == 0) {
+      stats = true;
+    } else if (std::strcmp(args[i], "--watch") == 0) {
+      watch = true;
+    } else if (std::strcmp(args[i], "--portable") == 0) {
+      options.backend = ScanBackend::FILESYSTEM;
+    } else if (std::strcmp(args[i], "--uring") == 0) {
+      options.backend = ScanBackend::URING;
+    } else if (std::strcmp(args[i], "--disk-usage") == 0) {
+      options.sizes = SizeMode::ALLOCATED;
+    } else {
+      dir = args[i];
+    }
+  }
+
+  if (dir == nullptr) {
+    std::cout << "Usage: filemap [-j threads] [--portable | --uring] [--disk-usage] "
+                 "[--watch] [--min-pixels N] [--min-size bytes] "
+                 "[--max-nodes N] [--exclude glob] [--include glob] "
+                 "[--max-depth N] [--one-file-system] "
+                 "[--save snapshot] [--diff snapshot] "
+                 "[--report text|json|csv] [--top N] [--stats] "
+                 "[directory | snapshot]"
+              << '\n';
     return 0;
   }
-  fs::path p(args[1]);
+  fs::path p(dir);
+  Stats::Enable(stats);
 
-  FileTree master_tree(p);
-  master_tree.Grow();
-  master_tree.CalcSizes();
+  // The scanner owns the listings, so must outlive the tree
+  ParallelScanner scanner(options);
+  const bool from_snapshot = fs::is_regular_file(p) and IsSnapshot(p);
 
-  std::vector<SDL_FRect> rects = MakeRects(master_tree, {0, 0, 900, 600});
+  std::unique_ptr<FileTree> tree;
+  try {
+    if (from_snapshot) {
+      tree = std::make_unique<FileTree>(LoadSnapshot(p));
+    } else {
+      tree = std::make_unique<FileTree>(p);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << '\n';
+    return 1;
+  }
+  FileTree &master_tree = *tree;
 
-  std::cout << master_tree.Size()
-            << " files, total size: " << FormatSize(master_tree.GetRoot().size)
-            << '\n';
+  if (from_snapshot) {
+    // Already fully grown
+  } else if (save_path or diff_path) {
+    // Need the full tree before it can be saved or compared
+    master_tree.Grow(scanner.Scan(p));
+  } else if (report) {
+    // Grow as the scan goes rather than at the end, so the listings are freed
+    // as they are used and don't all need to fit in memory at once
+    master_tree.GrowFrom(scanner.Start(p));
+    while (!master_tree.IsFullyGrown()) {
+      if (master_tree.GrowReady() == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+  } else {
+    // The scan runs in the background while the map shows what has been
+    // found so far
+    master_tree.GrowFrom(scanner.Start(p));
+  }
 
+  if (save_path) {
+    try {
+      SaveSnapshot(master_tree, save_path);
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      return 1;
+    }
+  }
+
+  // What changed since an earlier snapshot, shown and reported on instead
+  std::unique_ptr<TreeDiff> diff;
+  if (diff_path) {
+    try {
+      const FileTree before = LoadSnapshot(diff_path);
+      if (std::strcmp(before.GetName(0), master_tree.GetName(0)) != 0) {
+        std::clog << "Warning, comparing " << before.GetName(0) << " with "
+                  << master_tree.GetName(0) << '\n';
+      }
+      diff = std::make_unique<TreeDiff>(DiffTrees(before, master_tree));
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << '\n';
+      return 1;
+    }
+    // A report of no changes is still a report, in the format asked for
+    if (diff->tree.GetRoot().size == 0 and !report) {
+      std::cout << "No changes\n";
+      return 0;
+    }
+  }
+  FileTree &shown_tree = diff ? diff->tree : master_tree;
+
+  // To stderr, so reports on stdout stay machine readable
+  auto print_stats = [&]() {
+    if (!stats) { return; }
+    std::clog << '\n';
+    Stats::Print(std::clog);
+    std::clog << "node storage: " << FormatSize(shown_tree.MemoryUsage())
+              << "\npeak memory: " << FormatSize(Stats::PeakMemory()) << '\n';
+  };
+
+  if (report) {
+    WriteReport(shown_tree, report_options, std::cout);
+    print_stats();
+    return 0;
+  }
+
+#ifndef FILEMAP_HEADLESS
   {
     App main_window("filemap", 900, 600);
-    main_window.SetTarget(&master_tree, rects.data());
+    main_window.SetTarget(&shown_tree);
+    if (diff) { main_window.ShowDiff(&diff->delta); }
+    main_window.Watch(watch and !diff);
+    main_window.SetScanOptions(options, scanner.Inodes());
+    main_window.SetDetail(min_pixels);
+    main_window.ShowStats(stats);
 
     main_window.Run();
   }
+#else
+  (void)watch;
+  (void)min_pixels;
+#endif
+  scanner.Stop();
+
+  std::cout << shown_tree.Size()
+            << " files, total size: " << FormatSize(shown_tree.GetRoot().size)
+            << '\n';
+  print_stats();
   return 0;
 }
@@ -0,0 +1,256 @@
+#pragma once
+
+#include "debug.h"
+#include "filetree.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <ostream>
+#include <queue>
+#include <string>
+#include <vector>
+
+/* ============== Reports =====================
+ * Text, JSON or CSV reports of a grown FileTree, for running without a
+ * display. Everything is worked out in one pass over the nodes, using memory
+ * for the top N nodes and one entry per level of the tree, and only the
+ * paths of the nodes that are printed are ever built.
+ */
+
+enum class ReportFormat { TEXT, JSON, CSV };
+
+struct ReportOptions {
+  ReportFormat format = ReportFormat::TEXT;
+  // How many of the largest directories and files to list
+  std::size_t top = 20;
+};
+
+struct TreeSummary {
+  struct Level {
+    uintmax_t dirs = 0;
+    uintmax_t files = 0;
+    // Of the files only, directories' sizes are made up of the levels below
+    uintmax_t size = 0;
+  };
+
+  // Largest first, not including the root
+  std::vector<node_index_t> largest_dirs;
+  std::vector<node_index_t> largest_files;
+  // By depth, the root is level 0
+  std::vector<Level> levels;
+};
+
+// Depth of each node in turn, for a tree in the breadth-first order it was
+// grown in, without storing a depth per node
+class DepthTracker {
+public:
+  int Next(node_index_t i, node_index_t parent) {
+    if (i == 0) { return 0; }
+    // The first node whose parent is in the deepest level starts a new one
+    if (parent >= m_level_start.back()) { m_level_start.push_back(i); }
+    return (int)(std::upper_bound(m_level_start.begin(), m_level_start.end(),
+                                  parent) -
+                 m_level_start.begin());
+  }
+
+private:
+  std::vector<node_index_t> m_level_start = {0};
+};
+
+// Keeps the n largest nodes seen
+class TopN {
+public:
+  TopN(const FileTree &tree, std::size_t n)
+      : m_sizes(tree.Sizes()), m_n(n), m_heap(Smaller{m_sizes}) {}
+
+  void Add(node_index_t i) {
+    if (m_n == 0) { return; }
+    if (m_heap.size() < m_n) {
+      m_heap.push(i);
+    } else if (m_sizes[i] > m_sizes[m_heap.top()]) {
+      m_heap.pop();
+      m_heap.push(i);
+    }
+  }
+
+  // Largest first, empties this
+  std::vector<node_index_t> Take() {
+    std::vector<node_index_t> out(m_heap.size());
+    for (std::size_t i = out.size(); i-- > 0;) {
+      out[i] = m_heap.top();
+      m_heap.pop();
+    }
+    return out;
+  }
+
+private:
+  // Orders the heap smallest on top, ties by index so the output is stable
+  struct Smaller {
+    const uintmax_t *sizes;
+    bool operator()(node_index_t a, node_index_t b) const {
+      return sizes[a] != sizes[b] ? sizes[a] > sizes[b] : a < b;
+    }
+  };
+
+  const uintmax_t *m_sizes;
+  std::size_t m_n;
+  std::priority_queue<node_index_t, std::vector<node_index_t>, Smaller> m_heap;
+};
+
+TreeSummary Summarise(const FileTree &tree, std::size_t top) {
+  TreeSummary summary;
+  TopN dirs(tree, top), files(tree, top);
+  DepthTracker depths;
+
+  for (node_index_t i = 0; i < tree.Size(); ++i) {
+    const FileNode f = tree.GetFile(i);
+    const int depth = depths.Next(i, f.parent);
+    if (f.type == File::EMPTY) { continue; }
+
+    if ((std::size_t)depth >= summary.levels.size()) {
+      summary.levels.resize(depth + 1);
+    }
+    TreeSummary::Level &level = summary.levels[depth];
+    if (f.type == File::DIRECTORY) {
+      ++level.dirs;
+      if (i != 0) { dirs.Add(i); }
+    } else if (f.type == File::PRUNED) {
+      // Its size is only its own, so it isn't one of the largest
+      ++level.dirs;
+    } else {
+      ++level.files;
+      level.size += f.size;
+      // Not a file that can be found on disk
+      if (f.type != File::AGGREGATE) { files.Add(i); }
+    }
+  }
+
+  summary.largest_dirs = dirs.Take();
+  summary.largest_files = files.Take();
+  return summary;
+}
+
+namespace report_detail {
+
+void WriteJsonString(std::ostream &os, const std::string &s) {
+  os << '"';
+  for (unsigned char c : s) {
+    if (c == '"' or c == '\\') {
+      os << '\\' << c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      os << escaped;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+void WriteCsvString(std::ostream &os, const std::string &s) {
+  os << '"';
+  for (char c : s) {
+    if (c == '"') { os << '"'; }
+    os << c;
+  }
+  os << '"';
+}
+
+const char *TypeName(File::Type type) {
+  switch (type) {
+  case File::REGULAR: return "file";
+  case File::DIRECTORY: return "directory";
+  case File::SYMLINK: return "symlink";
+  case File::OTHER: return "other";
+  case File::EMPTY: return "empty";
+  case File::AGGREGATE: return "small files";
+  case File::PRUNED: return "pruned directory";
+  }
+  return "other";
+}
+
+void WriteText(const FileTree &tree, const TreeSummary &summary,
+               std::ostream &os) {
+  os << tree.GetName(0) << ": " << FormatSize(tree.GetRoot().size) << " in "
+     << tree.Size() << " files\n";
+
+  auto list = [&](const char *title, const std::vector<node_index_t> &nodes) {
+    os << '\n' << title << ":\n";
+    for (node_index_t i : nodes) {
+      os << "  " << FormatSize(tree.GetFile(i).size) << '\t'
+         << tree.GetPath(i).string() << '\n';
+    }
+  };
+  list("Largest directories", summary.largest_dirs);
+  list("Largest files", summary.largest_files);
+
+  os << "\nBy depth:\n  depth\tdirs\tfiles\tsize of files\n";
+  for (std::size_t d = 0; d < summary.levels.size(); ++d) {
+    const TreeSummary::Level &l = summary.levels[d];
+    os << "  " << d << '\t' << l.dirs << '\t' << l.files << '\t'
+       << FormatSize(l.size) << '\n';
+  }
+}
+
+void WriteJson(const FileTree &tree, const TreeSummary &summary,
+               std::ostream &os) {
+  os << "{\n  \"root\": ";
+  WriteJsonString(os, tree.GetName(0));
+  os << ",\n  \"size\": " << tree.GetRoot().size
+     << ",\n  \"nodes\": " << tree.Size();
+
+  auto list = [&](const char *key, const std::vector<node_index_t> &nodes) {
+    os << ",\n  \"" << key << "\": [";
+    for (std::size_t k = 0; k < nodes.size(); ++k) {
+      os << (k ? ",\n" : "\n") << "    {\"path\": ";
+      WriteJsonString(os, tree.GetPath(nodes[k]).string());
+      os << ", \"size\": " << tree.GetFile(nodes[k]).size << '}';
+    }
+    os << (nodes.empty() ? "]" : "\n  ]");
+  };
+  list("largest_dirs", summary.largest_dirs);
+  list("largest_files", summary.largest_files);
+
+  os << ",\n  \"levels\": [";
+  for (std::size_t d = 0; d < summary.levels.size(); ++d) {
+    const TreeSummary::Level &l = summary.levels[d];
+    os << (d ? ",\n" : "\n") << "    {\"depth\": " << d
+       << ", \"dirs\": " << l.dirs << ", \"files\": " << l.files
+       << ", \"size\": " << l.size << '}';
+  }
+  os << "\n  ]\n}\n";
+}
+
+// One line per node, with the parent's index rather than a full path so
+// nothing needs to be kept between lines
+void WriteCsv(const FileTree &tree, std::ostream &os) {
+  os << "index,parent,depth,type,size,name\n";
+  DepthTracker depths;
+  for (node_index_t i = 0; i < tree.Size(); ++i) {
+    const FileNode f = tree.GetFile(i);
+    const int depth = depths.Next(i, f.parent);
+    if (f.type == File::EMPTY) { continue; }
+
+    os << i << ',' << f.parent << ',' << depth << ',' << TypeName(f.type)
+       << ',' << f.size << ',';
+    WriteCsvString(os, tree.GetName(i));
+    os << '\n';
+  }
+}
+
+} // namespace report_detail
+
+void WriteReport(const FileTree &tree, const ReportOptions &options,
+                 std::ostream &os) {
+  assert(tree.IsFullyGrown());
+  switch (options.format) {
+  case ReportFormat::TEXT:
+    report_detail::WriteText(tree, Summarise(tree, options.top), os);
+    break;
+  case ReportFormat::JSON:
+    report_detail::WriteJson(tree, Summarise(tree, options.top), os);
+    break;
+  case ReportFormat::CSV: report_detail::WriteCsv(tree, os); break;
+  }
+}
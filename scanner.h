@@ -0,0 +1,982 @@
+#pragma once
+
+#include "filetree.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __unix__
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#endif
+
+// How directories are read
+enum class ScanBackend {
+  // Portable, uses fs::directory_iterator
+  FILESYSTEM,
+  // Linux only, reads directory fds with getdents64 and only stats when
+  // d_type can't tell us what we need. Falls back to FILESYSTEM elsewhere.
+  GETDENTS,
+  // As GETDENTS, but directories are opened and stat'd through io_uring, many
+  // at a time, so slow (network, spinning) disks have a deep queue of
+  // requests without needing hundreds of threads. Falls back to GETDENTS
+  // where io_uring isn't available.
+  URING,
+};
+
+#ifdef __linux__
+constexpr ScanBackend DEFAULT_BACKEND = ScanBackend::GETDENTS;
+#else
+constexpr ScanBackend DEFAULT_BACKEND = ScanBackend::FILESYSTEM;
+#endif
+
+// What the size of a file means
+enum class SizeMode {
+  // Length of the file's contents, what `ls -l` shows
+  APPARENT,
+  // Disk space actually allocated (st_blocks), with each hard-linked inode
+  // only counted the first time it is seen. Needs a stat for every entry, and
+  // is the same as APPARENT on systems without stat.
+  ALLOCATED,
+};
+
+struct ScanOptions {
+  // 0 uses one thread per hardware core
+  unsigned num_threads = 0;
+  ScanBackend backend = DEFAULT_BACKEND;
+  SizeMode sizes = SizeMode::APPARENT;
+
+  // Files smaller than this are folded into one "N small files" node per
+  // directory, see FoldSmallFiles
+  uintmax_t min_file_size = 0;
+  // Roughly the most nodes to make, 0 for no limit. As the scan nears it
+  // directories keep fewer of their largest files and fold the rest.
+  // Directories themselves are never folded, so can take the tree over it.
+  std::size_t max_nodes = 0;
+
+  // Globs of '*' and '?' matched against names, never whole paths. A name
+  // matching one of exclude, and none of include, is left out of the scan.
+  // Excluded directories are kept as a single PRUNED node without being
+  // opened.
+  std::vector<std::string> exclude;
+  std::vector<std::string> include;
+  // Directories this many levels below the root are PRUNED, 0 for no limit
+  unsigned max_depth = 0;
+  // Directories on another device to the root, e.g. /proc or network mounts,
+  // are PRUNED. Needs a stat of every directory.
+  bool one_file_system = false;
+};
+
+/* ============== InodeSet =====================
+ * The (device, inode) pairs seen so far, shared between scanning threads.
+ * Split into shards with their own lock so threads rarely wait on each other,
+ * and only files with more than one link ever need to go in.
+ */
+
+class InodeSet {
+public:
+  // True the first time an inode is inserted
+  bool Insert(uint64_t dev, uint64_t ino);
+
+private:
+  struct Key {
+    uint64_t dev;
+    uint64_t ino;
+    bool operator==(const Key &o) const { return dev == o.dev and ino == o.ino; }
+  };
+  struct KeyHash {
+    std::size_t operator()(const Key &k) const {
+      // Inode numbers are close to unique on their own, mix in dev cheaply
+      return std::hash<uint64_t>()(k.ino ^ (k.dev * 0x9e3779b97f4a7c15ull));
+    }
+  };
+  struct Shard {
+    std::mutex lock;
+    std::unordered_set<Key, KeyHash> seen;
+  };
+
+  static constexpr std::size_t NUM_SHARDS = 64;
+  Shard m_shards[NUM_SHARDS];
+};
+
+bool InodeSet::Insert(uint64_t dev, uint64_t ino) {
+  const Key k{dev, ino};
+  Shard &s = m_shards[(ino * 0x9e3779b97f4a7c15ull >> 58) % NUM_SHARDS];
+  std::lock_guard<std::mutex> guard(s.lock);
+  return s.seen.insert(k).second;
+}
+
+#ifdef __unix__
+// Size of a file in the given mode, hard links are counted in inodes
+uintmax_t StatSize(const struct stat &st, SizeMode sizes, InodeSet &inodes) {
+  if (sizes == SizeMode::APPARENT) { return (uintmax_t)st.st_size; }
+
+  // Directories can't be hard linked, and their '.' and '..' links don't
+  // count
+  if (!S_ISDIR(st.st_mode) and st.st_nlink > 1 and
+      !inodes.Insert((uint64_t)st.st_dev, (uint64_t)st.st_ino)) {
+    return 0;
+  }
+  return (uintmax_t)st.st_blocks * 512;
+}
+#endif
+
+#ifdef __linux__
+// Submission queue size of each scanning thread's ring
+constexpr unsigned URING_ENTRIES = 1024;
+// Most directories a thread reads at once with ScanBackend::URING
+constexpr std::size_t URING_BATCH_DIRS = 32;
+
+/* ============== UringBatch =====================
+ * Directory opens and stats submitted through io_uring in batches, then
+ * waited for together. Uses the raw syscalls rather than liburing, which
+ * isn't always installed. Each scanning thread has its own.
+ *
+ * The paths, names and buffers passed in must stay put until Wait returns.
+ */
+
+class UringBatch {
+public:
+  UringBatch();
+  ~UringBatch();
+  UringBatch(const UringBatch &) = delete;
+  UringBatch &operator=(const UringBatch &) = delete;
+
+  // False if io_uring, or an operation we need, isn't available
+  bool Ok() const { return m_fd >= 0; }
+
+  // Open a directory, *result is its fd or -errno
+  void OpenDir(const char *path, int *result);
+  // statx name relative to dir_fd without following symlinks or automounts,
+  // *result is 0 or -errno
+  void Stat(int dir_fd, const char *name, struct statx *out, int *result);
+  // Submit everything added so far and wait for all of it to finish
+  void Wait();
+
+private:
+  io_uring_sqe &Next(int *result);
+  // Submit what has been added and reap at least min_complete completions
+  void Enter(unsigned min_complete);
+
+private:
+  int m_fd;
+  void *m_rings;
+  std::size_t m_rings_bytes;
+  io_uring_sqe *m_sqes;
+  std::size_t m_sqes_bytes;
+
+  unsigned *m_sq_tail;
+  unsigned m_sq_mask;
+  unsigned *m_sq_array;
+  unsigned *m_cq_head;
+  unsigned *m_cq_tail;
+  unsigned m_cq_mask;
+  io_uring_cqe *m_cqes;
+
+  unsigned m_entries;
+  // Added but not submitted, and submitted but not completed
+  unsigned m_queued;
+  unsigned m_in_flight;
+};
+
+UringBatch::UringBatch()
+    : m_fd(-1), m_rings(MAP_FAILED), m_rings_bytes(0), m_sqes(nullptr),
+      m_sqes_bytes(0), m_sq_tail(nullptr), m_sq_mask(0), m_sq_array(nullptr),
+      m_cq_head(nullptr), m_cq_tail(nullptr), m_cq_mask(0), m_cqes(nullptr),
+      m_entries(0), m_queued(0), m_in_flight(0) {
+#ifdef __NR_io_uring_setup
+  io_uring_params params = {};
+  const int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0) { return; }
+
+  // Kernels too old to have these would fail every request
+  alignas(io_uring_probe) char probe_buffer[sizeof(io_uring_probe) +
+                                            256 * sizeof(io_uring_probe_op)] =
+      {};
+  auto *probe = reinterpret_cast<io_uring_probe *>(probe_buffer);
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) <
+          0 or
+      probe->last_op < IORING_OP_STATX or
+      !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) or
+      !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) or
+      !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(fd);
+    return;
+  }
+
+  // Both queues share one mapping, the submission entries have their own
+  m_rings_bytes =
+      std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+  m_rings = mmap(nullptr, m_rings_bytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  m_sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+  void *sqes = mmap(nullptr, m_sqes_bytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (m_rings == MAP_FAILED or sqes == MAP_FAILED) {
+    if (m_rings != MAP_FAILED) { munmap(m_rings, m_rings_bytes); }
+    if (sqes != MAP_FAILED) { munmap(sqes, m_sqes_bytes); }
+    m_rings = MAP_FAILED;
+    close(fd);
+    return;
+  }
+
+  char *rings = static_cast<char *>(m_rings);
+  m_sqes = static_cast<io_uring_sqe *>(sqes);
+  m_sq_tail = reinterpret_cast<unsigned *>(rings + params.sq_off.tail);
+  m_sq_mask = *reinterpret_cast<unsigned *>(rings + params.sq_off.ring_mask);
+  m_sq_array = reinterpret_cast<unsigned *>(rings + params.sq_off.array);
+  m_cq_head = reinterpret_cast<unsigned *>(rings + params.cq_off.head);
+  m_cq_tail = reinterpret_cast<unsigned *>(rings + params.cq_off.tail);
+  m_cq_mask = *reinterpret_cast<unsigned *>(rings + params.cq_off.ring_mask);
+  m_cqes = reinterpret_cast<io_uring_cqe *>(rings + params.cq_off.cqes);
+  m_entries = params.sq_entries;
+  m_fd = fd;
+#endif
+}
+
+UringBatch::~UringBatch() {
+  if (m_fd < 0) { return; }
+  munmap(m_sqes, m_sqes_bytes);
+  munmap(m_rings, m_rings_bytes);
+  close(m_fd);
+}
+
+void UringBatch::OpenDir(const char *path, int *result) {
+  io_uring_sqe &sqe = Next(result);
+  sqe.opcode = IORING_OP_OPENAT;
+  sqe.fd = AT_FDCWD;
+  sqe.addr = (uint64_t)(uintptr_t)path;
+  sqe.open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+}
+
+void UringBatch::Stat(int dir_fd, const char *name, struct statx *out,
+                      int *result) {
+  io_uring_sqe &sqe = Next(result);
+  sqe.opcode = IORING_OP_STATX;
+  sqe.fd = dir_fd;
+  sqe.addr = (uint64_t)(uintptr_t)name;
+  sqe.len = STATX_BASIC_STATS;
+  sqe.off = (uint64_t)(uintptr_t)out;
+  sqe.statx_flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT;
+}
+
+io_uring_sqe &UringBatch::Next(int *result) {
+  // Full, make room by waiting for some of what is in flight
+  if (m_queued + m_in_flight == m_entries) { Enter(1); }
+
+  const unsigned tail = *m_sq_tail;
+  const unsigned index = tail & m_sq_mask;
+  io_uring_sqe &sqe = m_sqes[index];
+  sqe = {};
+  sqe.user_data = (uint64_t)(uintptr_t)result;
+  m_sq_array[index] = index;
+  // The kernel only reads the entry once it sees the new tail
+  __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++m_queued;
+  return sqe;
+}
+
+void UringBatch::Wait() {
+  while (m_queued + m_in_flight > 0) {
+    Enter(m_queued + m_in_flight);
+  }
+}
+
+void UringBatch::Enter(unsigned min_complete) {
+#ifdef __NR_io_uring_enter
+  const long submitted =
+      syscall(__NR_io_uring_enter, m_fd, m_queued, min_complete,
+              IORING_ENTER_GETEVENTS, nullptr, 0);
+  if (submitted > 0) {
+    m_queued -= (unsigned)submitted;
+    m_in_flight += (unsigned)submitted;
+  } else if (submitted < 0 and errno != EINTR and errno != EAGAIN and
+             errno != EBUSY) {
+    // Can't submit at all, the entries never ran, so fail them and let the
+    // caller take the slow way. The tail goes back to before them, or the
+    // next submit would run them after their buffers have gone.
+    const unsigned first = *m_sq_tail - m_queued;
+    for (unsigned i = first; m_queued > 0; --m_queued, ++i) {
+      *(int *)(uintptr_t)m_sqes[i & m_sq_mask].user_data = -EIO;
+    }
+    __atomic_store_n(m_sq_tail, first, __ATOMIC_RELEASE);
+  }
+#endif
+
+  unsigned head = *m_cq_head;
+  const unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    const io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+    *(int *)(uintptr_t)cqe.user_data = cqe.res;
+    --m_in_flight;
+  }
+  __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+/* ============== ParallelScanner =====================
+ * Scans a directory tree on several threads, producing a tree of DirListings
+ * that FileTree::Grow(DirListing &) turns into the flat node array.
+ *
+ * Each worker owns a queue of directories waiting to be read. New
+ * subdirectories are pushed onto the back of the worker's own queue and popped
+ * from the back (depth-first, good locality), while idle workers steal from the
+ * front of other queues (the oldest, usually largest, pending subtrees).
+ *
+ * The scan can run in the background (Start) while a FileTree picks up
+ * listings as they become ready with GrowFrom/GrowReady.
+ */
+
+class ParallelScanner {
+public:
+  // Hard links are counted in inodes if given, e.g. to carry on from an
+  // earlier scan, or a set of the scanner's own
+  explicit ParallelScanner(const ScanOptions &options = ScanOptions(),
+                           InodeSet *inodes = nullptr);
+  ~ParallelScanner() { Stop(); }
+
+  // Scan the whole tree below root, blocking until finished
+  DirListing &Scan(const fs::path &root);
+
+  // Start scanning root on the worker threads and return straight away. The
+  // listings are owned by the scanner. depth is root's level below the top
+  // of the tree being scanned, which max_depth counts from.
+  DirListing &Start(const fs::path &root, unsigned depth = 0);
+  // Block until the scan started with Start finishes, printing progress
+  void Wait();
+  // Abandon the scan, unfinished listings are left empty and not ready
+  void Stop();
+
+  bool Done() const { return m_pending == 0; }
+  std::size_t NumFiles() const { return m_num_files; }
+  unsigned NumThreads() const { return m_num_threads; }
+  // The hard-linked inodes counted so far, for sizing files found later on
+  InodeSet &Inodes() { return *m_inodes; }
+
+  // Is a name left out by m_options.exclude and include
+  bool Excluded(const char *name) const;
+  // Should a directory depth levels below the top be left unopened, going by
+  // its name and depth
+  bool Prune(unsigned depth, const char *name) const {
+    return (m_options.max_depth > 0 and depth >= m_options.max_depth) or
+           Excluded(name);
+  }
+
+private:
+  struct WorkQueue {
+    std::mutex lock;
+    std::deque<DirListing *> items;
+  };
+
+  void Worker(unsigned id);
+
+  // Read a single directory into its listing, queueing any subdirectories
+  void ReadDir(unsigned id, DirListing &listing);
+  // Sort and fold a listing that has been read, and queue its subdirectories
+  void FinishDir(unsigned id, DirListing &listing);
+
+  // Fill listing.children, returns false if the directory can't be read
+  bool ReadDirFilesystem(DirListing &listing);
+#ifdef __linux__
+  bool ReadDirGetdents(DirListing &listing);
+  // Read several directories at once, with their opens and stats batched
+  // through ring. Returns which could be read.
+  std::vector<bool> ReadDirsUring(const std::vector<DirListing *> &batch,
+                                  UringBatch &ring);
+  // Does an entry of this d_type need a stat to get what we need
+  bool NeedsStat(unsigned char d_type) const {
+    return m_options.sizes == SizeMode::ALLOCATED or d_type == DT_REG or
+           d_type == DT_UNKNOWN or
+           (d_type == DT_DIR and m_options.one_file_system);
+  }
+  // Deal with an entry that is excluded or too deep before it is stat'd, if
+  // d_type says enough. Returns false if it still needs adding.
+  bool PruneEntry(DirListing &listing, const char *name,
+                  unsigned char d_type);
+  // Add an entry of a directory read with getdents64, st is null if it
+  // wasn't stat'd
+  void AddEntry(DirListing &listing, const char *name, unsigned char d_type,
+                const struct stat *st);
+#endif
+#ifdef __unix__
+  // Size of a file according to m_options.sizes
+  uintmax_t StatSize(const struct stat &st);
+#endif
+
+  // Should a subdirectory of listing be left unopened
+  bool Prune(const DirListing &listing, const char *name) const {
+    return Prune(listing.depth + 1, name);
+  }
+#ifdef __unix__
+  // Is a directory on another device to the root, with one_file_system
+  bool OtherDevice(const struct stat &st) const {
+    return m_options.one_file_system and st.st_dev != m_root_dev;
+  }
+#endif
+
+  // How many files the directory being read can keep under max_nodes
+  std::size_t FilesToKeep() const;
+
+  void Push(unsigned id, DirListing *listing);
+  // The next directory for worker id, from another worker if steal is set and
+  // its own queue is empty
+  DirListing *Pop(unsigned id, bool steal = true);
+  // Wake workers waiting for something to be queued, or for the scan to end
+  void Wake(bool all);
+
+private:
+  ScanOptions m_options;
+  unsigned m_num_threads;
+  InodeSet m_own_inodes;
+  InodeSet *m_inodes;
+  std::unique_ptr<WorkQueue[]> m_queues;
+  std::vector<std::thread> m_workers;
+  std::unique_ptr<DirListing> m_root;
+#ifdef __unix__
+  // Device of the root, for one_file_system
+  dev_t m_root_dev = 0;
+#endif
+
+  // Directories queued or being read, the scan is finished when this hits 0
+  std::atomic<std::size_t> m_pending;
+  std::atomic<std::size_t> m_num_files;
+  std::atomic<bool> m_stop;
+
+  // Workers with nothing to do wait here rather than spin, see Worker
+  std::mutex m_idle_lock;
+  std::condition_variable m_idle;
+  std::atomic<unsigned> m_num_idle;
+  // Directories in all the queues
+  std::atomic<std::size_t> m_num_queued;
+};
+
+ParallelScanner::ParallelScanner(const ScanOptions &options,
+                                 InodeSet *inodes)
+    : m_options(options), m_num_threads(options.num_threads),
+      m_inodes(inodes ? inodes : &m_own_inodes), m_pending(0), m_num_files(0),
+      m_stop(false), m_num_idle(0), m_num_queued(0) {
+  if (m_num_threads == 0) {
+    m_num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  m_queues = std::make_unique<WorkQueue[]>(m_num_threads);
+}
+
+DirListing &ParallelScanner::Scan(const fs::path &root) {
+  DirListing &listing = Start(root);
+  Wait();
+  return listing;
+}
+
+DirListing &ParallelScanner::Start(const fs::path &root, unsigned depth) {
+  assert(m_workers.empty());
+
+  m_root = std::make_unique<DirListing>(root);
+  m_root->depth = depth;
+#ifdef __unix__
+  struct stat st;
+  m_root_dev = stat(root.c_str(), &st) == 0 ? st.st_dev : 0;
+#endif
+  m_num_files = 1;
+  m_pending = 1;
+  m_stop = false;
+  Push(0, m_root.get());
+
+  for (unsigned i = 0; i < m_num_threads; ++i) {
+    m_workers.emplace_back(&ParallelScanner::Worker, this, i);
+  }
+  return *m_root;
+}
+
+void ParallelScanner::Wait() {
+  // To stderr, so reports on stdout stay machine readable
+  std::clog << '\n';
+  while (!Done() and !m_stop) {
+    std::clog << "\x1B[2K\r" << m_num_files << " files" << std::flush;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  std::clog << "\x1B[2K\r\n";
+
+  for (std::thread &t : m_workers) {
+    t.join();
+  }
+  m_workers.clear();
+}
+
+void ParallelScanner::Stop() {
+  m_stop = true;
+  Wake(true);
+  for (std::thread &t : m_workers) {
+    t.join();
+  }
+  m_workers.clear();
+}
+
+void ParallelScanner::Worker(unsigned id) {
+#ifdef __linux__
+  std::unique_ptr<UringBatch> ring;
+  if (m_options.backend == ScanBackend::URING) {
+    ring = std::make_unique<UringBatch>();
+    if (!ring->Ok()) {
+      ring.reset();
+      if (id == 0) {
+        std::clog << "Warning, io_uring isn't available, reading directories "
+                     "one at a time\n";
+      }
+    }
+  }
+  std::vector<DirListing *> batch;
+#endif
+
+  while (m_pending > 0 and !m_stop) {
+    DirListing *listing = Pop(id);
+    if (listing == nullptr) {
+      // Everyone else is busy on a directory that hasn't queued any work yet,
+      // sleep until they do
+      std::unique_lock<std::mutex> lock(m_idle_lock);
+      ++m_num_idle;
+      m_idle.wait(lock, [&]() {
+        return m_num_queued > 0 or m_pending == 0 or m_stop;
+      });
+      --m_num_idle;
+      continue;
+    }
+
+#ifdef __linux__
+    if (ring) {
+      // Only take more from our own queue, leaving the rest to be stolen
+      batch = {listing};
+      while (batch.size() < URING_BATCH_DIRS) {
+        DirListing *next = Pop(id, false);
+        if (next == nullptr) { break; }
+        batch.push_back(next);
+      }
+
+      std::vector<bool> ok;
+      {
+        PhaseTimer timer(Phase::READ_DIR);
+        Stats::Count(Counter::DIRS_READ, batch.size());
+        ok = ReadDirsUring(batch, *ring);
+      }
+      for (std::size_t i = 0; i < batch.size(); ++i) {
+        if (ok[i]) { FinishDir(id, *batch[i]); }
+        batch[i]->ready.store(true, std::memory_order_release);
+        if (--m_pending == 0) { Wake(true); }
+      }
+      continue;
+    }
+#endif
+
+    ReadDir(id, *listing);
+    listing->ready.store(true, std::memory_order_release);
+    if (--m_pending == 0) { Wake(true); }
+  }
+}
+
+void ParallelScanner::ReadDir(unsigned id, DirListing &listing) {
+  bool ok;
+  {
+    PhaseTimer timer(Phase::READ_DIR);
+    Stats::Count(Counter::DIRS_READ);
+    switch (m_options.backend) {
+#ifdef __linux__
+    case ScanBackend::GETDENTS:
+    case ScanBackend::URING: ok = ReadDirGetdents(listing); break;
+#endif
+    default: ok = ReadDirFilesystem(listing); break;
+    }
+  }
+  if (ok) { FinishDir(id, listing); }
+}
+
+void ParallelScanner::FinishDir(unsigned id, DirListing &listing) {
+  {
+    PhaseTimer timer(Phase::SORT);
+    std::sort(listing.children.begin(), listing.children.end(), FileOrder);
+  }
+  if (m_options.min_file_size > 0 or m_options.max_nodes > 0) {
+    FoldSmallFiles(listing.children, FilesToKeep(), m_options.min_file_size);
+  }
+  m_num_files += listing.children.size();
+
+  // Directories sort to the front of children
+  for (const File &c : listing.children) {
+    if (c.type != File::DIRECTORY) { break; }
+    listing.subdirs.push_back(
+        std::make_unique<DirListing>(listing.path / c.name));
+    listing.subdirs.back()->depth = listing.depth + 1;
+  }
+
+  m_pending += listing.subdirs.size();
+  for (const std::unique_ptr<DirListing> &d : listing.subdirs) {
+    Push(id, d.get());
+  }
+}
+
+std::size_t ParallelScanner::FilesToKeep() const {
+  if (m_options.max_nodes == 0) { return SIZE_MAX; }
+  // Share what is left between the directories still to be read, keeping
+  // back a node each for their folded files. Those read first get the
+  // biggest share, and are nearer the root where their files are drawn
+  // largest.
+  const std::size_t used = m_num_files;
+  const std::size_t pending = std::max<std::size_t>(1, m_pending);
+  if (used + pending >= m_options.max_nodes) { return 0; }
+  return (m_options.max_nodes - used - pending) / pending;
+}
+
+bool ParallelScanner::Excluded(const char *name) const {
+  auto any = [&](const std::vector<std::string> &globs) {
+    for (const std::string &g : globs) {
+      if (GlobMatch(g.c_str(), name)) { return true; }
+    }
+    return false;
+  };
+  return any(m_options.exclude) and !any(m_options.include);
+}
+
+bool ParallelScanner::ReadDirFilesystem(DirListing &listing) {
+  std::error_code ec;
+  fs::directory_iterator it(listing.path, ec);
+  if (ec) {
+    std::clog << "Warning, unable to read " << listing.path << ": "
+              << ec.message() << '\n';
+    return false;
+  }
+
+  for (; it != fs::directory_iterator(); it.increment(ec)) {
+    const std::string name = it->path().filename().string();
+    if (it->symlink_status(ec).type() == fs::file_type::directory) {
+      bool prune = Prune(listing, name.c_str());
+#ifdef __unix__
+      struct stat st;
+      if (!prune and m_options.one_file_system and
+          lstat(it->path().c_str(), &st) == 0) {
+        Stats::Count(Counter::STAT_CALLS);
+        prune = OtherDevice(st);
+      }
+#endif
+      if (prune) {
+        listing.children.emplace_back(name, DIR_SIZE, File::PRUNED);
+        continue;
+      }
+    } else if (Excluded(name.c_str())) {
+      continue;
+    }
+    try {
+      listing.children.emplace_back(*it);
+    } catch (const fs::filesystem_error &) {
+      // Gone again since it was listed
+      continue;
+    }
+
+#ifdef __unix__
+    if (m_options.sizes == SizeMode::ALLOCATED) {
+      PhaseTimer timer(Phase::STAT);
+      Stats::Count(Counter::STAT_CALLS);
+      struct stat st;
+      if (lstat(it->path().c_str(), &st) == 0) {
+        File &f = listing.children.back();
+        f.size = StatSize(st);
+        f.uid = (uint32_t)st.st_uid;
+        f.mtime = (int64_t)st.st_mtime;
+      }
+    }
+#endif
+  }
+  return true;
+}
+
+#ifdef __unix__
+uintmax_t ParallelScanner::StatSize(const struct stat &st) {
+  return ::StatSize(st, m_options.sizes, *m_inodes);
+}
+#endif
+
+#ifdef __linux__
+// Layout of the records returned by getdents64, glibc doesn't always declare it
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+bool ParallelScanner::ReadDirGetdents(DirListing &listing) {
+  const int dir_fd =
+      open(listing.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    std::clog << "Warning, unable to read " << listing.path << ": "
+              << std::strerror(errno) << '\n';
+    return false;
+  }
+
+  alignas(LinuxDirent64) char buffer[1 << 15];
+  for (;;) {
+    const long n = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+    if (n <= 0) { break; }
+
+    for (long pos = 0; pos < n;) {
+      const auto *d = reinterpret_cast<const LinuxDirent64 *>(buffer + pos);
+      pos += d->d_reclen;
+
+      const char *name = d->d_name;
+      if (name[0] == '.' and
+          (name[1] == '\0' or (name[1] == '.' and name[2] == '\0'))) {
+        continue;
+      }
+      if (PruneEntry(listing, name, d->d_type)) { continue; }
+
+      // Only regular files (and filesystems that don't fill in d_type) need
+      // a stat for apparent sizes, and that is done relative to the open
+      // directory. Automount points are left unmounted.
+      if (NeedsStat(d->d_type)) {
+        struct stat st;
+        {
+          PhaseTimer timer(Phase::STAT);
+          Stats::Count(Counter::STAT_CALLS);
+          if (fstatat(dir_fd, name, &st,
+                      AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) != 0) {
+            continue;
+          }
+        }
+        AddEntry(listing, name, d->d_type, &st);
+      } else {
+        AddEntry(listing, name, d->d_type, nullptr);
+      }
+    }
+  }
+
+  close(dir_fd);
+  return true;
+}
+
+bool ParallelScanner::PruneEntry(DirListing &listing, const char *name,
+                                 unsigned char d_type) {
+  if (d_type == DT_DIR) {
+    if (!Prune(listing, name)) { return false; }
+    listing.children.emplace_back(name, DIR_SIZE, File::PRUNED);
+    return true;
+  }
+  return d_type != DT_UNKNOWN and Excluded(name);
+}
+
+void ParallelScanner::AddEntry(DirListing &listing, const char *name,
+                               unsigned char d_type, const struct stat *st) {
+  const bool allocated = m_options.sizes == SizeMode::ALLOCATED;
+  uintmax_t size = 0;
+  if (st) {
+    // Only now is it known what an entry without a d_type is
+    if (d_type == DT_UNKNOWN and
+        PruneEntry(listing, name, IFTODT(st->st_mode))) {
+      return;
+    }
+    size = StatSize(*st);
+    d_type = IFTODT(st->st_mode);
+  }
+
+  switch (d_type) {
+  case DT_DIR: {
+    if (st and OtherDevice(*st)) {
+      listing.children.emplace_back(name, DIR_SIZE, File::PRUNED);
+    } else {
+      listing.children.emplace_back(name, allocated ? size : DIR_SIZE,
+                                    File::DIRECTORY);
+    }
+  } break;
+
+  case DT_REG: {
+    listing.children.emplace_back(name, size, File::REGULAR);
+  } break;
+
+  case DT_LNK: {
+    listing.children.emplace_back(name, allocated ? size : SYMLINK_SIZE,
+                                  File::SYMLINK);
+  } break;
+
+  default: {
+    listing.children.emplace_back(name, allocated ? size : 0, File::OTHER);
+    std::clog << "Warning, unrecognised file: " << name << '\n';
+  } break;
+  }
+  if (st) {
+    listing.children.back().uid = (uint32_t)st->st_uid;
+    listing.children.back().mtime = (int64_t)st->st_mtime;
+  }
+}
+
+std::vector<bool>
+ParallelScanner::ReadDirsUring(const std::vector<DirListing *> &batch,
+                               UringBatch &ring) {
+  // Open every directory at once
+  std::vector<int> fds(batch.size());
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    ring.OpenDir(batch[i]->path.c_str(), &fds[i]);
+  }
+  ring.Wait();
+
+  // Read their entries, keeping the names in one buffer that doesn't move
+  // once the stats are submitted
+  struct Entry {
+    std::size_t dir;
+    std::size_t name;
+    unsigned char d_type;
+    int result;
+  };
+  std::vector<Entry> entries;
+  std::vector<char> names;
+  std::vector<bool> ok(batch.size(), false);
+  alignas(LinuxDirent64) char buffer[1 << 15];
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    if (fds[i] < 0) {
+      // The ring may have failed rather than the open, try the slow way
+      fds[i] = open(batch[i]->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fds[i] < 0) {
+      std::clog << "Warning, unable to read " << batch[i]->path << ": "
+                << std::strerror(errno) << '\n';
+      continue;
+    }
+    ok[i] = true;
+    for (;;) {
+      const long n = syscall(SYS_getdents64, fds[i], buffer, sizeof(buffer));
+      if (n <= 0) { break; }
+
+      for (long pos = 0; pos < n;) {
+        const auto *d = reinterpret_cast<const LinuxDirent64 *>(buffer + pos);
+        pos += d->d_reclen;
+
+        const char *name = d->d_name;
+        if (name[0] == '.' and
+            (name[1] == '\0' or (name[1] == '.' and name[2] == '\0'))) {
+          continue;
+        }
+        if (PruneEntry(*batch[i], name, d->d_type)) { continue; }
+        entries.push_back({i, names.size(), d->d_type, 0});
+        names.insert(names.end(), name, name + std::strlen(name) + 1);
+      }
+    }
+  }
+
+  // Then stat everything that needs it in one go
+  std::vector<struct statx> stats(entries.size());
+  std::size_t num_stats = 0;
+  for (std::size_t e = 0; e < entries.size(); ++e) {
+    if (!NeedsStat(entries[e].d_type)) { continue; }
+    ring.Stat(fds[entries[e].dir], names.data() + entries[e].name, &stats[e],
+              &entries[e].result);
+    ++num_stats;
+  }
+  {
+    PhaseTimer timer(Phase::STAT);
+    Stats::Count(Counter::STAT_CALLS, num_stats);
+    ring.Wait();
+  }
+
+  for (std::size_t e = 0; e < entries.size(); ++e) {
+    const Entry &entry = entries[e];
+    const char *name = names.data() + entry.name;
+    DirListing &listing = *batch[entry.dir];
+    if (!NeedsStat(entry.d_type)) {
+      AddEntry(listing, name, entry.d_type, nullptr);
+      continue;
+    }
+
+    struct stat st;
+    if (entry.result == 0) {
+      const struct statx &x = stats[e];
+      st = {};
+      st.st_dev = makedev(x.stx_dev_major, x.stx_dev_minor);
+      st.st_ino = x.stx_ino;
+      st.st_mode = x.stx_mode;
+      st.st_nlink = x.stx_nlink;
+      st.st_uid = x.stx_uid;
+      st.st_size = (off_t)x.stx_size;
+      st.st_blocks = (blkcnt_t)x.stx_blocks;
+      st.st_mtime = (time_t)x.stx_mtime.tv_sec;
+    } else if (fstatat(fds[entry.dir], name, &st,
+                       AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) != 0) {
+      // Gone since it was listed, or the ring couldn't stat it
+      continue;
+    }
+    AddEntry(listing, name, entry.d_type, &st);
+  }
+
+  for (int fd : fds) {
+    if (fd >= 0) { close(fd); }
+  }
+  return ok;
+}
+#endif
+
+void ParallelScanner::Push(unsigned id, DirListing *listing) {
+  {
+    WorkQueue &q = m_queues[id];
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.items.push_back(listing);
+    // Before anyone can take it, so Pop never takes the count below 0
+    ++m_num_queued;
+  }
+  Wake(false);
+}
+
+DirListing *ParallelScanner::Pop(unsigned id, bool steal) {
+  {
+    WorkQueue &q = m_queues[id];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (!q.items.empty()) {
+      DirListing *listing = q.items.back();
+      q.items.pop_back();
+      --m_num_queued;
+      return listing;
+    }
+  }
+
+  // Our queue is empty, try to steal from everyone else in turn
+  for (unsigned i = 1; steal and i < m_num_threads; ++i) {
+    WorkQueue &q = m_queues[(id + i) % m_num_threads];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (!q.items.empty()) {
+      DirListing *listing = q.items.front();
+      q.items.pop_front();
+      --m_num_queued;
+      return listing;
+    }
+  }
+  return nullptr;
+}
+
+void ParallelScanner::Wake(bool all) {
+  // A worker counts itself idle before checking whether to wait, so either it
+  // sees the change or we see it. Nobody idle is the usual case, and needs no
+  // lock.
+  if (m_num_idle == 0) { return; }
+  // Once we have the lock, an idle worker is either already waiting or yet to
+  // check, and can't miss the notify in between
+  { std::lock_guard<std::mutex> guard(m_idle_lock); }
+  if (all) {
+    m_idle.notify_all();
+  } else {
+    m_idle.notify_one();
+  }
+}
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "filetree.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Nodes per block of the name index
+constexpr node_index_t SEARCH_BLOCK_SIZE = 128;
+
+/* ============== NameIndex =====================
+ * Finds the nodes whose names match a pattern, without comparing against
+ * every name in the tree. The nodes are split into blocks of
+ * SEARCH_BLOCK_SIZE, and for each trigram we keep the blocks with a name
+ * containing it. A query only checks the blocks that have every trigram of its
+ * literal parts, so usually very few.
+ *
+ * Trigrams are of characters folded down to 64 classes (see Class), so the
+ * lists fit in a flat table instead of a hash map. Folding only adds blocks
+ * that get checked for nothing.
+ *
+ * Keeping blocks rather than nodes makes the index much smaller, as siblings
+ * (which are next to each other) tend to share most of their trigrams.
+ *
+ * The index is added to as the tree grows, a full block at a time. Nodes past
+ * the last full block are checked on every query. Nodes whose names change
+ * in place (see FileTree::Insert) need a Refresh.
+ */
+
+// Every name matching a pattern
+struct SearchResult {
+  enum Mark : uint8_t { NONE, MATCH, CONTAINS_MATCH };
+
+  // In index order
+  std::vector<node_index_t> matches;
+  // Total size of the matches, not counting matches inside other matches
+  uintmax_t size = 0;
+  // One per node, whether it matches or has a match somewhere below it
+  std::vector<Mark> marks;
+};
+
+class NameIndex {
+public:
+  explicit NameIndex(const FileTree *tree = nullptr) : m_tree(tree) {}
+
+  // Index any nodes added to the tree since the last call
+  void Update();
+  // Index the names in range again after they have changed
+  void Refresh(NodeRange range);
+
+  // Case-insensitive. A pattern with '*' or '?' must match the whole name,
+  // anything else matches names that contain it.
+  SearchResult Search(const std::string &pattern, unsigned num_threads = 0);
+
+  // Does name match a glob pattern of '*' and '?', ignoring ASCII case
+  static bool GlobMatch(const char *pattern, const char *name);
+
+  // Bytes used by the index
+  std::size_t MemoryUsage() const;
+
+private:
+  static char Lower(char c) {
+    return (c >= 'A' and c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+  }
+  // Letters ignoring case, digits, and the rest shared between what's left
+  static uint32_t Class(char c) {
+    const uint8_t u = (uint8_t)Lower(c);
+    if (u >= 'a' and u <= 'z') { return u - 'a'; }
+    if (u >= '0' and u <= '9') { return 26 + (u - '0'); }
+    return 36 + u % 28;
+  }
+  static uint32_t Trigram(const char *s) {
+    return (Class(s[0]) << 12) | (Class(s[1]) << 6) | Class(s[2]);
+  }
+  // Every trigram in the names of block b, without repeats
+  void BlockTrigrams(uint32_t b, std::vector<uint32_t> &out);
+  // Blocks that could have a name matching glob, sorted
+  std::vector<uint32_t> Candidates(const std::string &glob) const;
+
+private:
+  const FileTree *m_tree;
+  // Blocks indexed so far, all full
+  uint32_t m_num_blocks = 0;
+  // Trigram -> blocks, sorted
+  std::vector<std::vector<uint32_t>> m_postings =
+      std::vector<std::vector<uint32_t>>(1 << 18);
+  // Trigrams already seen in the block being indexed, cheaper than sorting
+  std::vector<bool> m_seen = std::vector<bool>(1 << 18);
+};
+
+void NameIndex::Update() {
+  if (m_tree == nullptr) { return; }
+  PhaseTimer timer(Phase::INDEX);
+
+  std::vector<uint32_t> trigrams;
+  while ((std::size_t)(m_num_blocks + 1) * SEARCH_BLOCK_SIZE <= m_tree->Size()) {
+    BlockTrigrams(m_num_blocks, trigrams);
+    for (uint32_t t : trigrams) {
+      m_postings[t].push_back(m_num_blocks);
+    }
+    ++m_num_blocks;
+  }
+}
+
+void NameIndex::Refresh(NodeRange range) {
+  if (range.empty()) { return; }
+  const uint32_t last = std::min((range.last - 1) / SEARCH_BLOCK_SIZE + 1,
+                                 m_num_blocks);
+  std::vector<uint32_t> trigrams;
+  for (uint32_t b = range.first / SEARCH_BLOCK_SIZE; b < last; ++b) {
+    // Trigrams that went with old names are left, they only cost a block
+    // being checked for nothing
+    BlockTrigrams(b, trigrams);
+    for (uint32_t t : trigrams) {
+      std::vector<uint32_t> &blocks = m_postings[t];
+      auto it = std::lower_bound(blocks.begin(), blocks.end(), b);
+      if (it == blocks.end() or *it != b) { blocks.insert(it, b); }
+    }
+  }
+}
+
+void NameIndex::BlockTrigrams(uint32_t b, std::vector<uint32_t> &out) {
+  out.clear();
+  const node_index_t first = b * SEARCH_BLOCK_SIZE;
+  for (node_index_t i = first; i < first + SEARCH_BLOCK_SIZE; ++i) {
+    const char *name = m_tree->GetName(i);
+    for (std::size_t k = 0; name[k] and name[k + 1] and name[k + 2]; ++k) {
+      const uint32_t t = Trigram(name + k);
+      if (!m_seen[t]) {
+        m_seen[t] = true;
+        out.push_back(t);
+      }
+    }
+  }
+  for (uint32_t t : out) {
+    m_seen[t] = false;
+  }
+}
+
+std::vector<uint32_t> NameIndex::Candidates(const std::string &glob) const {
+  // Trigrams of the literal runs between wildcards, rarest first
+  std::vector<const std::vector<uint32_t> *> lists;
+  std::size_t run = 0;
+  for (std::size_t k = 0; k <= glob.size(); ++k) {
+    if (k < glob.size() and glob[k] != '*' and glob[k] != '?') {
+      if (++run >= 3) {
+        lists.push_back(&m_postings[Trigram(glob.c_str() + k - 2)]);
+      }
+    } else {
+      run = 0;
+    }
+  }
+
+  std::vector<uint32_t> blocks;
+  if (lists.empty()) {
+    // Nothing to narrow it down, check everything
+    blocks.resize(m_num_blocks);
+    for (uint32_t b = 0; b < m_num_blocks; ++b) {
+      blocks[b] = b;
+    }
+    return blocks;
+  }
+
+  std::sort(lists.begin(), lists.end(),
+            [](auto *a, auto *b) { return a->size() < b->size(); });
+  blocks = *lists[0];
+  std::vector<uint32_t> both;
+  for (std::size_t l = 1; l < lists.size() and !blocks.empty(); ++l) {
+    both.clear();
+    std::set_intersection(blocks.begin(), blocks.end(), lists[l]->begin(),
+                          lists[l]->end(), std::back_inserter(both));
+    blocks.swap(both);
+  }
+  return blocks;
+}
+
+SearchResult NameIndex::Search(const std::string &pattern,
+                               unsigned num_threads) {
+  Update();
+  PhaseTimer timer(Phase::SEARCH);
+
+  SearchResult result;
+  if (m_tree == nullptr or pattern.empty()) { return result; }
+  const bool is_glob = pattern.find_first_of("*?") != std::string::npos;
+  const std::string glob = is_glob ? pattern : '*' + pattern + '*';
+
+  // Candidate blocks, then whatever isn't in a full block yet, as node ranges
+  std::vector<NodeRange> ranges;
+  for (uint32_t b : Candidates(glob)) {
+    ranges.emplace_back(b * SEARCH_BLOCK_SIZE, (b + 1) * SEARCH_BLOCK_SIZE);
+  }
+  ranges.emplace_back(m_num_blocks * SEARCH_BLOCK_SIZE,
+                      (node_index_t)m_tree->Size());
+
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = (unsigned)std::min<std::size_t>(num_threads, ranges.size());
+
+  // Each thread checks a contiguous share of the ranges, so the matches come
+  // out in order
+  std::vector<std::vector<node_index_t>> found(num_threads);
+  auto check = [&](unsigned t) {
+    const std::size_t r0 = ranges.size() * t / num_threads;
+    const std::size_t r1 = ranges.size() * (t + 1) / num_threads;
+    for (std::size_t r = r0; r < r1; ++r) {
+      for (node_index_t i : ranges[r]) {
+        if (m_tree->GetFile(i).type != File::EMPTY and
+            GlobMatch(glob.c_str(), m_tree->GetName(i))) {
+          found[t].push_back(i);
+        }
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < num_threads; ++t) {
+    threads.emplace_back(check, t);
+  }
+  check(0);
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  for (const std::vector<node_index_t> &f : found) {
+    result.matches.insert(result.matches.end(), f.begin(), f.end());
+  }
+
+  // Parents are always before their children, so a match's ancestors are
+  // all marked by the time we reach it
+  result.marks.assign(m_tree->Size(), SearchResult::NONE);
+  for (node_index_t m : result.matches) {
+    bool inside_match = false;
+    for (node_index_t a = m; a != 0;) {
+      a = m_tree->GetFile(a).parent;
+      if (result.marks[a] == SearchResult::MATCH) { inside_match = true; }
+      if (result.marks[a] == SearchResult::NONE) {
+        result.marks[a] = SearchResult::CONTAINS_MATCH;
+      }
+    }
+    result.marks[m] = SearchResult::MATCH;
+    if (!inside_match) { result.size += m_tree->GetFile(m).size; }
+  }
+  return result;
+}
+
+bool NameIndex::GlobMatch(const char *pattern, const char *name) {
+  return ::GlobMatch(pattern, name, true);
+}
+
+std::size_t NameIndex::MemoryUsage() const {
+  std::size_t bytes = m_postings.size() * sizeof(m_postings[0]);
+  for (const std::vector<uint32_t> &blocks : m_postings) {
+    bytes += blocks.capacity() * sizeof(uint32_t);
+  }
+  return bytes;
+}
@@ -0,0 +1,366 @@
+#pragma once
+
+#include "filetree.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* ============== Snapshots =====================
+ * A FileTree saved to disk so it can be reopened without rescanning.
+ * The file is laid out to be mapped and used in place: a header followed by
+ * each of FileTree's columns as a raw array, each starting on a 64 byte
+ * boundary, then the tables of owners and extensions. Loading points the
+ * columns at the mapped memory, after one pass to check every node's indices
+ * stay inside the file.
+ *
+ * Snapshots use the byte order and type sizes of the machine that wrote them,
+ * and are rejected by a machine where these differ.
+ */
+
+constexpr char SNAPSHOT_MAGIC[8] = {'F', 'I', 'L', 'E', 'M', 'A', 'P', '\0'};
+// 2 added the extension, owner and age columns
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+constexpr uint64_t SNAPSHOT_ALIGN = 64;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t num_nodes;
+  uint64_t names_bytes;
+  uint64_t num_owners;
+  uint64_t num_extensions;
+  // Null-terminated, in id order
+  uint64_t extensions_bytes;
+  int64_t scan_time;
+
+  // Byte offsets of each column from the start of the file
+  uint64_t size_offset;
+  uint64_t parent_offset;
+  uint64_t first_child_offset;
+  uint64_t child_count_offset;
+  uint64_t name_offset;
+  uint64_t type_offset;
+  uint64_t names_offset;
+  uint64_t extension_offset;
+  uint64_t owner_offset;
+  uint64_t age_offset;
+  uint64_t owners_offset;
+  uint64_t extensions_offset;
+
+  uint64_t file_bytes;
+};
+
+static_assert(sizeof(uintmax_t) == sizeof(uint64_t),
+              "snapshot sizes are stored as 64 bit");
+
+// Save a fully grown tree
+void SaveSnapshot(const FileTree &tree, const fs::path &file);
+
+// Load a snapshot, mapping it into memory where possible. Throws
+// std::runtime_error if the file isn't a snapshot we can read.
+FileTree LoadSnapshot(const fs::path &file);
+
+// Does file start with the snapshot magic
+bool IsSnapshot(const fs::path &file);
+
+namespace snapshot_detail {
+
+inline uint64_t Align(uint64_t offset) {
+  return (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+}
+
+// Header for a tree of n nodes, with the columns laid out one after another
+inline SnapshotHeader MakeHeader(uint64_t n, uint64_t names_bytes,
+                                 uint64_t num_owners, uint64_t num_extensions,
+                                 uint64_t extensions_bytes,
+                                 int64_t scan_time) {
+  SnapshotHeader h{};
+  std::memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+  h.version = SNAPSHOT_VERSION;
+  h.byte_order = SNAPSHOT_BYTE_ORDER;
+  h.num_nodes = n;
+  h.names_bytes = names_bytes;
+  h.num_owners = num_owners;
+  h.num_extensions = num_extensions;
+  h.extensions_bytes = extensions_bytes;
+  h.scan_time = scan_time;
+
+  h.size_offset = Align(sizeof(SnapshotHeader));
+  h.parent_offset = Align(h.size_offset + n * sizeof(uintmax_t));
+  h.first_child_offset = Align(h.parent_offset + n * sizeof(node_index_t));
+  h.child_count_offset =
+      Align(h.first_child_offset + n * sizeof(node_index_t));
+  h.name_offset = Align(h.child_count_offset + n * sizeof(node_index_t));
+  h.type_offset = Align(h.name_offset + n * sizeof(name_offset_t));
+  h.names_offset = Align(h.type_offset + n * sizeof(File::Type));
+  h.extension_offset = Align(h.names_offset + names_bytes);
+  h.owner_offset = Align(h.extension_offset + n * sizeof(uint16_t));
+  h.age_offset = Align(h.owner_offset + n * sizeof(uint16_t));
+  h.owners_offset = Align(h.age_offset + n * sizeof(Age));
+  h.extensions_offset = Align(h.owners_offset + num_owners * sizeof(uint32_t));
+  h.file_bytes = h.extensions_offset + extensions_bytes;
+  return h;
+}
+
+// Writes sequentially, padding with zeros up to each offset
+class SnapshotWriter {
+public:
+  explicit SnapshotWriter(std::FILE *f) : m_file(f), m_offset(0) {}
+
+  void WriteAt(uint64_t offset, const void *data, std::size_t bytes) {
+    static const char zeros[SNAPSHOT_ALIGN] = {};
+    assert(offset >= m_offset and offset - m_offset <= SNAPSHOT_ALIGN);
+    Write(zeros, offset - m_offset);
+    Write(data, bytes);
+  }
+
+private:
+  void Write(const void *data, std::size_t bytes) {
+    if (bytes and std::fwrite(data, 1, bytes, m_file) != bytes) {
+      throw std::runtime_error("failed to write snapshot");
+    }
+    m_offset += bytes;
+  }
+
+  std::FILE *m_file;
+  uint64_t m_offset;
+};
+
+// The whole snapshot file in memory, mapped if we can
+class MappedFile {
+public:
+  explicit MappedFile(const fs::path &file);
+  ~MappedFile();
+
+  const char *Data() const { return m_data; }
+  std::size_t Bytes() const { return m_bytes; }
+
+private:
+  const char *m_data;
+  std::size_t m_bytes;
+#ifndef __unix__
+  std::vector<char> m_buffer;
+#endif
+};
+
+#ifdef __unix__
+MappedFile::MappedFile(const fs::path &file) : m_data(nullptr), m_bytes(0) {
+  const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) { throw std::runtime_error("unable to open " + file.string()); }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("unable to stat " + file.string());
+  }
+  m_bytes = (std::size_t)st.st_size;
+
+  void *p = mmap(nullptr, m_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    throw std::runtime_error("unable to map " + file.string());
+  }
+  m_data = (const char *)p;
+}
+
+MappedFile::~MappedFile() {
+  if (m_data) { munmap((void *)m_data, m_bytes); }
+}
+#else
+MappedFile::MappedFile(const fs::path &file) : m_data(nullptr), m_bytes(0) {
+  std::FILE *f = std::fopen(file.string().c_str(), "rb");
+  if (f == nullptr) {
+    throw std::runtime_error("unable to open " + file.string());
+  }
+  m_buffer.resize(fs::file_size(file));
+  m_bytes = std::fread(m_buffer.data(), 1, m_buffer.size(), f);
+  std::fclose(f);
+  m_data = m_buffer.data();
+}
+
+MappedFile::~MappedFile() {}
+#endif
+
+} // namespace snapshot_detail
+
+void SaveSnapshot(const FileTree &tree, const fs::path &file) {
+  using namespace snapshot_detail;
+  assert(tree.IsFullyGrown());
+
+  const uint64_t n = tree.Size();
+  std::string extensions;
+  for (const std::string &e : tree.m_extensions) {
+    extensions.append(e.c_str(), e.size() + 1);
+  }
+  const SnapshotHeader h =
+      MakeHeader(n, tree.m_names.size(), tree.m_owners.size(),
+                 tree.m_extensions.size(), extensions.size(),
+                 (int64_t)tree.m_scan_time);
+
+  // Write to a temporary file first so a failed save can't clobber a good
+  // snapshot
+  const fs::path tmp = file.string() + ".tmp";
+  std::FILE *f = std::fopen(tmp.string().c_str(), "wb");
+  if (f == nullptr) {
+    throw std::runtime_error("unable to create " + tmp.string());
+  }
+
+  try {
+    SnapshotWriter w(f);
+    w.WriteAt(0, &h, sizeof(h));
+    w.WriteAt(h.size_offset, tree.m_size.data(), n * sizeof(uintmax_t));
+    w.WriteAt(h.parent_offset, tree.m_parent.data(), n * sizeof(node_index_t));
+    w.WriteAt(h.first_child_offset, tree.m_first_child.data(),
+              n * sizeof(node_index_t));
+    w.WriteAt(h.child_count_offset, tree.m_child_count.data(),
+              n * sizeof(node_index_t));
+    w.WriteAt(h.name_offset, tree.m_name.data(), n * sizeof(name_offset_t));
+    w.WriteAt(h.type_offset, tree.m_type.data(), n * sizeof(File::Type));
+    w.WriteAt(h.names_offset, tree.m_names.data(), h.names_bytes);
+    w.WriteAt(h.extension_offset, tree.m_extension.data(),
+              n * sizeof(uint16_t));
+    w.WriteAt(h.owner_offset, tree.m_owner.data(), n * sizeof(uint16_t));
+    w.WriteAt(h.age_offset, tree.m_age.data(), n * sizeof(Age));
+    w.WriteAt(h.owners_offset, tree.m_owners.data(),
+              h.num_owners * sizeof(uint32_t));
+    w.WriteAt(h.extensions_offset, extensions.data(), h.extensions_bytes);
+  } catch (...) {
+    std::fclose(f);
+    fs::remove(tmp);
+    throw;
+  }
+
+  if (std::fclose(f) != 0) {
+    fs::remove(tmp);
+    throw std::runtime_error("failed to write snapshot");
+  }
+  fs::rename(tmp, file);
+}
+
+FileTree LoadSnapshot(const fs::path &file) {
+  using namespace snapshot_detail;
+
+  auto mapping = std::make_shared<const MappedFile>(file);
+  const char *base = mapping->Data();
+
+  SnapshotHeader h;
+  if (mapping->Bytes() < sizeof(h)) {
+    throw std::runtime_error(file.string() + " is not a snapshot");
+  }
+  std::memcpy(&h, base, sizeof(h));
+
+  if (std::memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0) {
+    throw std::runtime_error(file.string() + " is not a snapshot");
+  }
+  if (h.version != SNAPSHOT_VERSION) {
+    throw std::runtime_error(file.string() + " has unsupported version " +
+                             std::to_string(h.version));
+  }
+  if (h.byte_order != SNAPSHOT_BYTE_ORDER) {
+    throw std::runtime_error(file.string() +
+                             " was written by a different kind of machine");
+  }
+  // The layout is fixed by the node and name counts, so anything else means
+  // the file has been damaged
+  const SnapshotHeader expected =
+      MakeHeader(h.num_nodes, h.names_bytes, h.num_owners, h.num_extensions,
+                 h.extensions_bytes, h.scan_time);
+  if (h.num_nodes == 0 or h.num_nodes > UINT32_MAX or
+      h.names_bytes > UINT32_MAX or h.num_owners == 0 or
+      h.num_owners > UINT16_MAX + 1 or h.num_extensions == 0 or
+      h.num_extensions > UINT16_MAX + 1 or h.extensions_bytes > UINT32_MAX or
+      std::memcmp(&h, &expected, sizeof(h)) != 0 or
+      h.file_bytes != mapping->Bytes()) {
+    throw std::runtime_error(file.string() + " is truncated or corrupt");
+  }
+
+  const std::size_t n = h.num_nodes;
+  FileTree tree;
+  tree.m_size.View((const uintmax_t *)(base + h.size_offset), n);
+  tree.m_parent.View((const node_index_t *)(base + h.parent_offset), n);
+  tree.m_first_child.View((const node_index_t *)(base + h.first_child_offset),
+                          n);
+  tree.m_child_count.View((const node_index_t *)(base + h.child_count_offset),
+                          n);
+  tree.m_name.View((const name_offset_t *)(base + h.name_offset), n);
+  tree.m_type.View((const File::Type *)(base + h.type_offset), n);
+  tree.m_names.View(base + h.names_offset, h.names_bytes);
+  tree.m_extension.View((const uint16_t *)(base + h.extension_offset), n);
+  tree.m_owner.View((const uint16_t *)(base + h.owner_offset), n);
+  tree.m_age.View((const Age *)(base + h.age_offset), n);
+
+  // The tables are small, so are copied to keep adding to
+  const uint32_t *owners = (const uint32_t *)(base + h.owners_offset);
+  tree.m_owners.assign(owners, owners + h.num_owners);
+  const char *ext = base + h.extensions_offset;
+  const char *ext_end = ext + h.extensions_bytes;
+  tree.m_extensions.clear();
+  while (ext < ext_end) {
+    const std::size_t len = strnlen(ext, (std::size_t)(ext_end - ext));
+    tree.m_extensions.emplace_back(ext, len);
+    ext += len + 1;
+  }
+  if (tree.m_extensions.size() != h.num_extensions) {
+    throw std::runtime_error(file.string() + " is truncated or corrupt");
+  }
+  for (std::size_t i = 1; i < tree.m_owners.size(); ++i) {
+    tree.m_owner_ids.emplace(tree.m_owners[i], (uint16_t)i);
+  }
+  for (std::size_t i = 1; i < tree.m_extensions.size(); ++i) {
+    tree.m_extension_ids.emplace(tree.m_extensions[i], (uint16_t)i);
+  }
+
+  // The nodes are used as they are, so anything out of range would be read
+  // outside the file later on rather than fail here. One pass over them,
+  // with every node in at most one child range, is enough.
+  const char *names = base + h.names_offset;
+  bool ok = h.names_bytes > 0 and names[h.names_bytes - 1] == '\0';
+  std::size_t num_children = 0;
+  for (node_index_t i = 0; ok and i < n; ++i) {
+    const node_index_t first = tree.m_first_child[i];
+    const node_index_t count = tree.m_child_count[i];
+    num_children += count;
+    ok = tree.m_name[i] < h.names_bytes and tree.m_type[i] <= File::PRUNED and
+         tree.m_extension[i] < tree.m_extensions.size() and
+         tree.m_owner[i] < tree.m_owners.size() and
+         tree.m_age[i] < Age::NUM_AGES and
+         (i == 0 ? tree.m_parent[i] == NULL_INDEX : tree.m_parent[i] < i) and
+         num_children < n and
+         (count == 0 or (first > i and (uint64_t)first + count <= n));
+    for (node_index_t c = first; ok and c < first + count; ++c) {
+      ok = tree.m_parent[c] == i;
+    }
+    if (tree.m_type[i] == File::EMPTY) { ++tree.m_empty; }
+  }
+  if (!ok) {
+    throw std::runtime_error(file.string() + " is truncated or corrupt");
+  }
+
+  tree.m_compacted_names = h.names_bytes;
+  tree.m_scan_time = (std::time_t)h.scan_time;
+  tree.m_grow_index = (node_index_t)n;
+  tree.m_backing = mapping;
+  return tree;
+}
+
+bool IsSnapshot(const fs::path &file) {
+  char magic[sizeof(SNAPSHOT_MAGIC)] = {};
+  std::FILE *f = std::fopen(file.string().c_str(), "rb");
+  if (f == nullptr) { return false; }
+  const std::size_t n = std::fread(magic, 1, sizeof(magic), f);
+  std::fclose(f);
+  return n == sizeof(magic) and
+         std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+
+#ifdef __unix__
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+/* ============== Stats =====================
+ * Where the time goes, for --stats and the stats overlay. Code marks a phase
+ * with a PhaseTimer and bumps counters with Stats::Count, both can be called
+ * from any thread. While stats are disabled (the default) each of these is a
+ * single relaxed load and a branch.
+ */
+
+enum class Phase {
+  // Reading a directory, including its stats
+  READ_DIR,
+  STAT,
+  // Sorting a directory's entries
+  SORT,
+  // Adding nodes to the tree
+  GROW,
+  LAYOUT,
+  DRAW_TILES,
+  HIT_TEST,
+  // Adding to the name index, and searching it
+  INDEX,
+  SEARCH,
+  // Totalling attributes, see attributes.h
+  AGGREGATE,
+  // Comparing two trees, see diff.h
+  DIFF,
+  FRAME,
+  NUM_PHASES,
+};
+
+enum class Counter {
+  DIRS_READ,
+  STAT_CALLS,
+  FILES_FOLDED,
+  TILES_DRAWN,
+  NUM_COUNTERS,
+};
+
+class Stats {
+public:
+  struct Totals {
+    uint64_t calls;
+    uint64_t wall_ns;
+    // CPU time of the thread that ran the phase, not of any threads it
+    // started
+    uint64_t cpu_ns;
+    uint64_t max_ns;
+    uint64_t last_ns;
+  };
+
+  static bool Enabled() { return s_enabled.load(std::memory_order_relaxed); }
+  static void Enable(bool enabled) { s_enabled = enabled; }
+
+  static void Count(Counter c, uint64_t n = 1) {
+    if (Enabled()) {
+      s_counters[(int)c].fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+  static void Record(Phase p, uint64_t wall_ns, uint64_t cpu_ns);
+
+  static Totals Get(Phase p);
+  static uint64_t Get(Counter c) { return s_counters[(int)c]; }
+  static const char *Name(Phase p);
+  static const char *Name(Counter c);
+
+  // Most memory the process has used, in bytes, 0 if unknown
+  static std::size_t PeakMemory();
+
+  static void Print(std::ostream &os);
+
+private:
+  // Only used for statics, which start zeroed
+  struct AtomicTotals {
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> wall_ns;
+    std::atomic<uint64_t> cpu_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> last_ns;
+  };
+
+  static inline std::atomic<bool> s_enabled{false};
+  static inline AtomicTotals s_phases[(int)Phase::NUM_PHASES];
+  static inline std::atomic<uint64_t> s_counters[(int)Counter::NUM_COUNTERS];
+};
+
+// Times the scope it is in as a phase, if stats are enabled
+class PhaseTimer {
+public:
+  explicit PhaseTimer(Phase p) : m_phase(p), m_enabled(Stats::Enabled()) {
+    if (m_enabled) {
+      m_wall = WallNs();
+      m_cpu = ThreadCpuNs();
+    }
+  }
+  ~PhaseTimer() {
+    if (m_enabled) {
+      Stats::Record(m_phase, WallNs() - m_wall, ThreadCpuNs() - m_cpu);
+    }
+  }
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+  static uint64_t WallNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  static uint64_t ThreadCpuNs() {
+#ifdef __unix__
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return (uint64_t)t.tv_sec * 1000000000ull + (uint64_t)t.tv_nsec;
+#else
+    return 0;
+#endif
+  }
+
+private:
+  Phase m_phase;
+  bool m_enabled;
+  uint64_t m_wall = 0;
+  uint64_t m_cpu = 0;
+};
+
+void Stats::Record(Phase p, uint64_t wall_ns, uint64_t cpu_ns) {
+  AtomicTotals &t = s_phases[(int)p];
+  t.calls.fetch_add(1, std::memory_order_relaxed);
+  t.wall_ns.fetch_add(wall_ns, std::memory_order_relaxed);
+  t.cpu_ns.fetch_add(cpu_ns, std::memory_order_relaxed);
+  t.last_ns.store(wall_ns, std::memory_order_relaxed);
+
+  uint64_t max = t.max_ns.load(std::memory_order_relaxed);
+  while (wall_ns > max and
+         !t.max_ns.compare_exchange_weak(max, wall_ns,
+                                         std::memory_order_relaxed)) {
+  }
+}
+
+Stats::Totals Stats::Get(Phase p) {
+  const AtomicTotals &t = s_phases[(int)p];
+  return {t.calls, t.wall_ns, t.cpu_ns, t.max_ns, t.last_ns};
+}
+
+const char *Stats::Name(Phase p) {
+  switch (p) {
+  case Phase::READ_DIR: return "read dir";
+  case Phase::STAT: return "stat";
+  case Phase::SORT: return "sort";
+  case Phase::GROW: return "grow";
+  case Phase::LAYOUT: return "layout";
+  case Phase::DRAW_TILES: return "draw tiles";
+  case Phase::HIT_TEST: return "hit-test";
+  case Phase::INDEX: return "index";
+  case Phase::SEARCH: return "search";
+  case Phase::AGGREGATE: return "aggregate";
+  case Phase::DIFF: return "diff";
+  case Phase::FRAME: return "frame";
+  case Phase::NUM_PHASES: break;
+  }
+  return "?";
+}
+
+const char *Stats::Name(Counter c) {
+  switch (c) {
+  case Counter::DIRS_READ: return "directories read";
+  case Counter::STAT_CALLS: return "stat calls";
+  case Counter::FILES_FOLDED: return "small files folded";
+  case Counter::TILES_DRAWN: return "tiles drawn";
+  case Counter::NUM_COUNTERS: break;
+  }
+  return "?";
+}
+
+std::size_t Stats::PeakMemory() {
+#ifdef __unix__
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) { return 0; }
+#ifdef __APPLE__
+  return (std::size_t)usage.ru_maxrss;
+#else
+  return (std::size_t)usage.ru_maxrss * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+void Stats::Print(std::ostream &os) {
+  char line[128];
+  std::snprintf(line, sizeof(line), "%-12s %10s %12s %12s %10s %10s\n",
+                "phase", "calls", "wall ms", "cpu ms", "avg ms", "max ms");
+  os << line;
+  for (int i = 0; i < (int)Phase::NUM_PHASES; ++i) {
+    const Totals t = Get((Phase)i);
+    if (t.calls == 0) { continue; }
+    std::snprintf(line, sizeof(line),
+                  "%-12s %10llu %12.2f %12.2f %10.3f %10.3f\n",
+                  Name((Phase)i), (unsigned long long)t.calls,
+                  (double)t.wall_ns / 1e6, (double)t.cpu_ns / 1e6,
+                  (double)t.wall_ns / 1e6 / (double)t.calls,
+                  (double)t.max_ns / 1e6);
+    os << line;
+  }
+  for (int i = 0; i < (int)Counter::NUM_COUNTERS; ++i) {
+    os << Name((Counter)i) << ": " << Get((Counter)i) << '\n';
+  }
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "filetree.h"
+
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+/* ============== Synthetic trees =====================
+ * Made up directory trees for benchmarking, the same every time for the same
+ * SyntheticSpec. A tree is made as DirListings, the same as ParallelScanner
+ * produces, so it can be grown into a FileTree straight away or written out
+ * to disk (ideally a tmpfs) to benchmark scanning.
+ */
+
+enum class SizeDistribution {
+  // Every file the same size, the worst case for the squarified layout
+  EQUAL,
+  // Uniform between 0 and 64KiB
+  UNIFORM,
+  // Mostly small with a long tail of big files, like a real disk
+  PARETO,
+};
+
+struct SyntheticSpec {
+  // A balanced tree, each directory has 'fanout' subdirectories (down to
+  // 'depth') and 'files' files
+  unsigned fanout = 6;
+  unsigned depth = 5;
+  unsigned files = 20;
+  SizeDistribution sizes = SizeDistribution::PARETO;
+
+  // Files in one extra, very wide directory below the root
+  std::size_t wide = 100000;
+  // Length of a chain of nested directories below the root, with one file
+  // in each. Each adds 2 to the length of the deepest path, which has to
+  // stay under PATH_MAX to be written to disk.
+  unsigned chain = 1000;
+
+  uint64_t seed = 1;
+};
+
+// The root of a synthetic tree, to start a FileTree with
+File SyntheticRoot(const fs::path &path) {
+  return File(path.string(), DIR_SIZE, File::DIRECTORY);
+}
+
+namespace synthetic_detail {
+
+class SizeGenerator {
+public:
+  SizeGenerator(SizeDistribution d, uint64_t seed) : m_dist(d), m_rng(seed) {}
+
+  uintmax_t Next() {
+    switch (m_dist) {
+    case SizeDistribution::EQUAL: return 4096;
+    case SizeDistribution::UNIFORM: return m_rng() % (64 * 1024);
+    case SizeDistribution::PARETO: {
+      // Minimum 512 bytes, alpha 1.2, capped at 64GiB
+      const double u = (double)(m_rng() >> 11) * 0x1.0p-53 + 0x1.0p-54;
+      return (uintmax_t)std::min(512.0 * std::pow(u, -1 / 1.2), 0x1.0p36);
+    }
+    }
+    return 0;
+  }
+
+private:
+  SizeDistribution m_dist;
+  std::mt19937_64 m_rng;
+};
+
+void AddFiles(DirListing &dir, std::size_t n, SizeGenerator &sizes) {
+  for (std::size_t i = 0; i < n; ++i) {
+    dir.children.emplace_back("f" + std::to_string(i), sizes.Next(),
+                              File::REGULAR);
+  }
+}
+
+DirListing &AddSubdir(DirListing &dir, const std::string &name) {
+  dir.children.emplace_back(name, DIR_SIZE, File::DIRECTORY);
+  dir.subdirs.push_back(std::make_unique<DirListing>(dir.path / name));
+  return *dir.subdirs.back();
+}
+
+// Sort the way ParallelScanner does, with subdirs in the same order as the
+// directories in children
+void Finish(DirListing &dir) {
+  std::sort(dir.children.begin(), dir.children.end(), FileOrder);
+  std::sort(dir.subdirs.begin(), dir.subdirs.end(),
+            [](const std::unique_ptr<DirListing> &a,
+               const std::unique_ptr<DirListing> &b) {
+              return a->path.filename().string() >
+                     b->path.filename().string();
+            });
+  dir.ready = true;
+}
+
+} // namespace synthetic_detail
+
+// Make the listings of a synthetic tree rooted at 'root'
+std::unique_ptr<DirListing> MakeSynthetic(const SyntheticSpec &spec,
+                                          const fs::path &root) {
+  using namespace synthetic_detail;
+  SizeGenerator sizes(spec.sizes, spec.seed);
+  auto top = std::make_unique<DirListing>(root);
+
+  // (directory, depth), iterative as the chain can be very deep
+  std::vector<std::pair<DirListing *, unsigned>> pending = {{top.get(), 0}};
+  while (!pending.empty()) {
+    auto [dir, depth] = pending.back();
+    pending.pop_back();
+
+    AddFiles(*dir, spec.files, sizes);
+    if (depth < spec.depth) {
+      for (unsigned i = 0; i < spec.fanout; ++i) {
+        pending.emplace_back(&AddSubdir(*dir, "d" + std::to_string(i)),
+                             depth + 1);
+      }
+    }
+  }
+
+  if (spec.wide > 0) {
+    DirListing &wide = AddSubdir(*top, "wide");
+    AddFiles(wide, spec.wide, sizes);
+  }
+  DirListing *link = top.get();
+  for (unsigned i = 0; i < spec.chain; ++i) {
+    link = &AddSubdir(*link, "c");
+    AddFiles(*link, 1, sizes);
+  }
+
+  // Sort everything once it has all been added
+  std::vector<DirListing *> all = {top.get()};
+  for (std::size_t i = 0; i < all.size(); ++i) {
+    for (const std::unique_ptr<DirListing> &d : all[i]->subdirs) {
+      all.push_back(d.get());
+    }
+  }
+  for (DirListing *d : all) {
+    Finish(*d);
+  }
+  return top;
+}
+
+// Create the files of a listing below its path on disk. Files are sparse, so
+// this is quick and takes little space whatever the sizes.
+void WriteSynthetic(const DirListing &root) {
+  std::vector<const DirListing *> pending = {&root};
+  while (!pending.empty()) {
+    const DirListing *dir = pending.back();
+    pending.pop_back();
+
+    fs::create_directories(dir->path);
+    for (const File &f : dir->children) {
+      if (f.type != File::REGULAR) { continue; }
+      const fs::path p = dir->path / f.name;
+      std::ofstream(p, std::ios::binary);
+      fs::resize_file(p, f.size);
+    }
+    for (const std::unique_ptr<DirListing> &d : dir->subdirs) {
+      pending.push_back(d.get());
+    }
+  }
+}
@@ -0,0 +1,343 @@
+// Checks of the tree's invariants after the ways it can be changed. Build and
+// run with `make test`, doesn't need SDL or a display.
+
+#include "diff.h"
+#include "filetree.h"
+#include "scanner.h"
+#include "snapshot.h"
+#include "synthetic.h"
+#include "watcher.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+
+// Unlike assert, still checks in release builds
+#define CHECK(x)                                                               \
+  do {                                                                         \
+    if (!(x)) {                                                                \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,    \
+                   #x);                                                        \
+      std::exit(1);                                                            \
+    }                                                                          \
+  } while (0)
+
+// A small synthetic tree, fully grown
+FileTree SmallTree() {
+  SyntheticSpec spec;
+  spec.fanout = 3;
+  spec.depth = 3;
+  spec.files = 4;
+  spec.wide = 0;
+  spec.chain = 0;
+  std::unique_ptr<DirListing> listing = MakeSynthetic(spec, "small");
+  FileTree tree(SyntheticRoot("small"));
+  tree.Grow(*listing);
+  return tree;
+}
+
+// Inserting, including into a directory whose child range is full and has to
+// move, leaves the tree fully grown
+void TestInsertStaysGrown() {
+  FileTree tree = SmallTree();
+  CHECK(tree.IsFullyGrown());
+
+  node_index_t dir = tree.Children(0).first;
+  CHECK(tree.Types()[dir] == File::DIRECTORY);
+  for (int i = 0; i < 50; ++i) {
+    std::vector<std::pair<node_index_t, node_index_t>> moved;
+    tree.Insert(0, File("new" + std::to_string(i), 100, File::REGULAR),
+                &moved);
+    CHECK(tree.IsFullyGrown());
+    for (auto [from, to] : moved) {
+      if (from == dir) { dir = to; }
+    }
+    tree.Insert(dir, File("deep" + std::to_string(i), 10, File::REGULAR),
+                &moved);
+    CHECK(tree.IsFullyGrown());
+  }
+}
+
+// Diffs of a tree that has been changed in place, with siblings' names no
+// longer in one run and EMPTY slots among them
+void TestDiffChangedTree() {
+  // The root's children are moved to the back with room to spare, which
+  // is left as EMPTY slots
+  auto change = [](FileTree &tree) {
+    for (int i = 0; i < 3; ++i) {
+      tree.Insert(0, File("new" + std::to_string(i), 100, File::REGULAR));
+    }
+    tree.Remove(tree.FindChild(0, "new1"));
+  };
+  const FileTree before = SmallTree();
+  FileTree after = SmallTree(), again = SmallTree();
+  change(after);
+  change(again);
+
+  const TreeDiff same = DiffTrees(after, again);
+  CHECK(same.tree.Size() == 1 and same.delta[0] == 0);
+
+  const TreeDiff diff = DiffTrees(before, after);
+  CHECK(diff.delta[0] ==
+        (intmax_t)after.GetRoot().size - (intmax_t)before.GetRoot().size);
+  CHECK(diff.tree.CountChildren(0) == 2);
+}
+
+// Compacting a changed tree drops its EMPTY slots and keeps everything else
+void TestCompact() {
+  FileTree tree = SmallTree();
+  for (int i = 0; i < 20; ++i) {
+    tree.Insert(0, File("new" + std::to_string(i), 100, File::REGULAR));
+  }
+  tree.Remove(tree.Children(0).first);
+  tree.Remove(tree.FindChild(0, "new3"));
+  CHECK(tree.EmptySlots() > 0);
+
+  const std::size_t size = tree.Size(), empty = tree.EmptySlots();
+  std::vector<std::pair<std::string, uintmax_t>> nodes;
+  for (node_index_t i = 0; i < size; ++i) {
+    nodes.emplace_back(tree.GetPath(i).string(), tree.GetFile(i).size);
+  }
+  const std::size_t names = tree.NamesSize();
+
+  const std::vector<node_index_t> new_index = tree.Compact();
+  CHECK(tree.IsFullyGrown() and tree.EmptySlots() == 0);
+  CHECK(tree.Size() == size - empty and tree.NamesSize() < names);
+  for (node_index_t i = 0; i < size; ++i) {
+    const node_index_t n = new_index[i];
+    if (i != 0 and n == NULL_INDEX) { continue; }
+    CHECK(tree.GetPath(n).string() == nodes[i].first);
+    CHECK(tree.GetFile(n).size == nodes[i].second);
+  }
+  for (node_index_t i = 1; i < tree.Size(); ++i) {
+    CHECK(tree.Types()[i] != File::EMPTY and tree.GetFile(i).parent < i);
+  }
+
+  // Still changes like any other tree
+  const uintmax_t root_size = tree.GetRoot().size;
+  tree.Insert(0, File("after", 1, File::REGULAR));
+  CHECK(tree.FindChild(0, "after") != NULL_INDEX);
+  CHECK(tree.GetRoot().size == root_size + 1);
+
+  // A rescan that finds the directory emptied leaves it all as garbage
+  FileTree rescanned = SmallTree();
+  CHECK(!rescanned.NeedsCompacting());
+  DirListing emptied("small");
+  emptied.ready = true;
+  rescanned.Replace(0, emptied);
+  CHECK(rescanned.NeedsCompacting());
+  rescanned.Compact();
+  CHECK(rescanned.Size() == 1 and !rescanned.NeedsCompacting());
+}
+
+// A snapshot whose nodes point outside it is rejected when loaded
+void TestCorruptSnapshot() {
+  const fs::path root = fs::temp_directory_path() / "filemap-tests";
+  fs::remove_all(root);
+  fs::create_directories(root);
+  const fs::path file = root / "small.snapshot";
+  SaveSnapshot(SmallTree(), file);
+  CHECK(LoadSnapshot(file).Size() == SmallTree().Size());
+
+  SnapshotHeader h;
+  std::ifstream(file, std::ios::binary).read((char *)&h, sizeof(h));
+  const uint32_t huge = 1u << 30;
+  // (offset, bytes) to overwrite: a parent, a child count, and the names'
+  // trailing null
+  const std::pair<uint64_t, std::string> damage[] = {
+      {h.parent_offset + 5 * sizeof(node_index_t),
+       std::string((const char *)&huge, sizeof(huge))},
+      {h.child_count_offset, std::string((const char *)&huge, sizeof(huge))},
+      {h.names_offset + h.names_bytes - 1, "x"},
+  };
+  for (const auto &[offset, bytes] : damage) {
+    SaveSnapshot(SmallTree(), file);
+    {
+      std::fstream f(file, std::ios::binary | std::ios::in | std::ios::out);
+      f.seekp((std::streamoff)offset);
+      f.write(bytes.data(), (std::streamsize)bytes.size());
+    }
+    bool rejected = false;
+    try {
+      LoadSnapshot(file);
+    } catch (const std::runtime_error &) {
+      rejected = true;
+    }
+    CHECK(rejected);
+  }
+  fs::remove_all(root);
+}
+
+// Excluded directories are kept as PRUNED nodes, even when they are smaller
+// than the files being folded
+void TestPrunedNotFolded() {
+  const fs::path root = fs::temp_directory_path() / "filemap-tests";
+  fs::remove_all(root);
+  fs::create_directories(root / "proc" / "inside");
+  fs::create_directories(root / "kept");
+  for (int i = 0; i < 5; ++i) {
+    std::ofstream(root / ("small" + std::to_string(i))) << "x";
+  }
+
+  ScanOptions options;
+  options.exclude = {"proc"};
+  options.min_file_size = 5000;
+  for (ScanBackend backend : {ScanBackend::FILESYSTEM, DEFAULT_BACKEND}) {
+    options.backend = backend;
+    ParallelScanner scanner(options);
+    FileTree tree(root);
+    // Scan quietly, Scan prints its progress
+    DirListing &listing = scanner.Start(root);
+    while (!scanner.Done()) {
+      std::this_thread::yield();
+    }
+    scanner.Stop();
+    tree.Grow(listing);
+
+    const node_index_t proc = tree.FindChild(0, "proc");
+    CHECK(proc != NULL_INDEX and tree.Types()[proc] == File::PRUNED);
+    CHECK(tree.CountChildren(proc) == 0);
+    const node_index_t kept = tree.FindChild(0, "kept");
+    CHECK(kept != NULL_INDEX and tree.Types()[kept] == File::DIRECTORY);
+    CHECK(tree.FindChild(0, "5 small files") != NULL_INDEX);
+  }
+  fs::remove_all(root);
+}
+
+#ifdef __linux__
+uintmax_t AllocatedSize(const fs::path &path) {
+  struct stat st;
+  CHECK(lstat(path.c_str(), &st) == 0);
+  return (uintmax_t)st.st_blocks * 512;
+}
+
+// Files the watcher finds are sized like the scan's, and hard links the scan
+// has counted aren't counted again
+void TestWatchSizes() {
+  const fs::path root = fs::temp_directory_path() / "filemap-tests";
+  fs::remove_all(root);
+  fs::create_directories(root / "sub");
+  std::ofstream(root / "a") << std::string(10000, 'a');
+  fs::create_hard_link(root / "a", root / "sub" / "first");
+
+  ScanOptions options;
+  options.sizes = SizeMode::ALLOCATED;
+  ParallelScanner scanner(options);
+  FileTree tree(root);
+  DirListing &listing = scanner.Start(root);
+  while (!scanner.Done()) {
+    std::this_thread::yield();
+  }
+  scanner.Stop();
+  tree.Grow(listing);
+
+  TreeWatcher watcher(tree, options, scanner.Inodes());
+  CHECK(watcher.IsWatching());
+  std::ofstream(root / "b") << std::string(20000, 'b');
+  fs::create_hard_link(root / "a", root / "sub" / "link");
+  fs::create_directories(root / "new");
+  std::ofstream(root / "new" / "c") << std::string(30000, 'c');
+  watcher.Poll();
+
+  const node_index_t sub = tree.FindChild(0, "sub");
+  const node_index_t link = tree.FindChild(sub, "link");
+  CHECK(link != NULL_INDEX and tree.GetFile(link).size == 0);
+  const node_index_t b = tree.FindChild(0, "b");
+  CHECK(b != NULL_INDEX and tree.GetFile(b).size == AllocatedSize(root / "b"));
+  const node_index_t added = tree.FindChild(0, "new");
+  CHECK(added != NULL_INDEX and
+        tree.GetFile(added).size ==
+            AllocatedSize(root / "new") + AllocatedSize(root / "new" / "c"));
+
+  // Whichever link the scan counted grows, the others stay at 0
+  std::ofstream(root / "a", std::ios::app) << std::string(50000, 'a');
+  watcher.Poll();
+  const uintmax_t a = tree.GetFile(tree.FindChild(0, "a")).size;
+  const uintmax_t first = tree.GetFile(tree.FindChild(sub, "first")).size;
+  CHECK(a + first == AllocatedSize(root / "a") and (a == 0 or first == 0));
+  CHECK(tree.GetFile(link).size == 0);
+
+  uintmax_t total = AllocatedSize(root);
+  for (node_index_t c : tree.Children(0)) {
+    total += tree.GetFile(c).size;
+  }
+  CHECK(tree.GetRoot().size == total);
+
+  // Once the tree is mostly garbage it is compacted, and the watches follow
+  for (int i = 0; i < 100; ++i) {
+    std::ofstream(root / "sub" / ("temp" + std::to_string(i))) << "t";
+  }
+  watcher.Poll();
+  for (int i = 0; i < 100; ++i) {
+    fs::remove(root / "sub" / ("temp" + std::to_string(i)));
+  }
+  watcher.Poll();
+  CHECK(tree.NeedsCompacting());
+  const std::vector<node_index_t> new_index = watcher.Compact();
+  CHECK(tree.EmptySlots() == 0 and !tree.NeedsCompacting());
+  std::ofstream(root / "sub" / "later") << "l";
+  watcher.Poll();
+  CHECK(tree.FindChild(new_index[sub], "later") != NULL_INDEX);
+  fs::remove_all(root);
+}
+
+// What the watcher finds is left out, pruned and folded just as the scan
+// would have
+void TestWatchOptions() {
+  const fs::path root = fs::temp_directory_path() / "filemap-tests";
+  fs::remove_all(root);
+  fs::create_directories(root);
+
+  ScanOptions options;
+  options.exclude = {"proc", "*.tmp"};
+  options.max_depth = 2;
+  options.min_file_size = 5000;
+  ParallelScanner scanner(options);
+  FileTree tree(root);
+  DirListing &listing = scanner.Start(root);
+  while (!scanner.Done()) {
+    std::this_thread::yield();
+  }
+  scanner.Stop();
+  tree.Grow(listing);
+
+  TreeWatcher watcher(tree, options, scanner.Inodes());
+  fs::create_directories(root / "proc" / "inside");
+  std::ofstream(root / "skip.tmp") << "x";
+  fs::create_directories(root / "deep" / "a" / "b");
+  fs::create_directories(root / "many");
+  for (int i = 0; i < 5; ++i) {
+    std::ofstream(root / "many" / ("small" + std::to_string(i))) << "x";
+  }
+  watcher.Poll();
+
+  const node_index_t proc = tree.FindChild(0, "proc");
+  CHECK(proc != NULL_INDEX and tree.Types()[proc] == File::PRUNED);
+  CHECK(tree.FindChild(0, "skip.tmp") == NULL_INDEX);
+  const node_index_t deep = tree.FindChild(0, "deep");
+  CHECK(deep != NULL_INDEX and tree.Types()[deep] == File::DIRECTORY);
+  const node_index_t a = tree.FindChild(deep, "a");
+  CHECK(a != NULL_INDEX and tree.Types()[a] == File::PRUNED);
+  CHECK(tree.CountChildren(a) == 0);
+  const node_index_t many = tree.FindChild(0, "many");
+  CHECK(many != NULL_INDEX and tree.CountChildren(many) == 1 and
+        tree.FindChild(many, "5 small files") != NULL_INDEX);
+  fs::remove_all(root);
+}
+#endif
+
+int main() {
+  TestInsertStaysGrown();
+  TestDiffChangedTree();
+  TestCompact();
+  TestCorruptSnapshot();
+  TestPrunedNotFolded();
+#ifdef __linux__
+  TestWatchSizes();
+  TestWatchOptions();
+#endif
+  std::printf("All tests passed\n");
+  return 0;
+}
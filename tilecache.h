@@ -0,0 +1,136 @@
+#pragma once
+
+#include "SDL.h"
+#include "filemap.h"
+
+#include <cmath>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// Width and height of a tile in pixels
+constexpr int TILE_SIZE = 256;
+// Most tiles to keep, each one is TILE_SIZE * TILE_SIZE * 4 bytes of texture
+constexpr std::size_t MAX_CACHED_TILES = 256;
+
+/* ============== TileCache =====================
+ * The map is drawn in TILE_SIZE square tiles at power of two zoom levels,
+ * level L being 2^L pixels per layout unit, so zooming in draws the map again
+ * at the new scale rather than stretching the old one. Tiles are kept (least
+ * recently used are reused first) so panning only draws what comes into view.
+ *
+ * What a tile shows only depends on the tree, not on how much of it has been
+ * laid out, so tiles only need forgetting when the tree changes.
+ */
+
+struct TileKey {
+  int level;
+  int x, y;
+};
+
+class TileCache {
+public:
+  explicit TileCache(SDL_Renderer *renderer) : m_renderer(renderer) {}
+  ~TileCache();
+  TileCache(const TileCache &) = delete;
+  TileCache &operator=(const TileCache &) = delete;
+
+  // Pixels per layout unit at a zoom level
+  static float Scale(int level) { return std::ldexp(1.0f, level); }
+  // The part of the layout a tile shows
+  static SDL_FRect Area(TileKey key);
+
+  // The tile's texture, or nullptr if it hasn't been drawn
+  SDL_Texture *Get(TileKey key);
+  // A texture to draw a new tile into
+  SDL_Texture *Add(TileKey key);
+
+  // Forget the tiles that overlap area
+  void Invalidate(SDL_FRect area);
+  void Clear();
+
+private:
+  struct Tile {
+    TileKey key;
+    SDL_Texture *texture;
+  };
+
+  static uint64_t Pack(TileKey key) {
+    return ((uint64_t)key.level << 56) | ((uint64_t)(uint32_t)key.x << 28) |
+           (uint64_t)(uint32_t)key.y;
+  }
+  void Forget(std::list<Tile>::iterator it);
+
+private:
+  SDL_Renderer *m_renderer;
+
+  // Most recently used first
+  std::list<Tile> m_tiles;
+  std::unordered_map<uint64_t, std::list<Tile>::iterator> m_index;
+  // Textures of forgotten tiles, to reuse
+  std::vector<SDL_Texture *> m_free;
+};
+
+TileCache::~TileCache() {
+  Clear();
+  for (SDL_Texture *t : m_free) {
+    SDL_DestroyTexture(t);
+  }
+}
+
+SDL_FRect TileCache::Area(TileKey key) {
+  const float side = TILE_SIZE / Scale(key.level);
+  return {key.x * side, key.y * side, side, side};
+}
+
+SDL_Texture *TileCache::Get(TileKey key) {
+  auto it = m_index.find(Pack(key));
+  if (it == m_index.end()) { return nullptr; }
+
+  m_tiles.splice(m_tiles.begin(), m_tiles, it->second);
+  return it->second->texture;
+}
+
+SDL_Texture *TileCache::Add(TileKey key) {
+  auto it = m_index.find(Pack(key));
+  if (it != m_index.end()) { Forget(it->second); }
+  if (m_tiles.size() >= MAX_CACHED_TILES) { Forget(std::prev(m_tiles.end())); }
+
+  SDL_Texture *texture;
+  if (!m_free.empty()) {
+    texture = m_free.back();
+    m_free.pop_back();
+  } else {
+    texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_RGBA8888,
+                                SDL_TEXTUREACCESS_TARGET, TILE_SIZE, TILE_SIZE);
+    if (texture == nullptr) {
+      printf("Unable to create tile texture: %s\n", SDL_GetError());
+      return nullptr;
+    }
+  }
+
+  m_tiles.push_front({key, texture});
+  m_index[Pack(key)] = m_tiles.begin();
+  return texture;
+}
+
+void TileCache::Invalidate(SDL_FRect area) {
+  for (auto it = m_tiles.begin(); it != m_tiles.end();) {
+    auto next = std::next(it);
+    if (Overlaps(Area(it->key), area)) { Forget(it); }
+    it = next;
+  }
+}
+
+void TileCache::Clear() {
+  while (!m_tiles.empty()) {
+    Forget(m_tiles.begin());
+  }
+}
+
+void TileCache::Forget(std::list<Tile>::iterator it) {
+  m_free.push_back(it->texture);
+  m_index.erase(Pack(it->key));
+  m_tiles.erase(it);
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include "filetree.h"
+#include "scanner.h"
+
+#include <optional>
+#include <set>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <cerrno>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* ============== TreeWatcher =====================
+ * Keeps a fully grown FileTree up to date with the filesystem, using inotify.
+ * Every directory in the tree gets a watch. Changes are applied to the tree
+ * directly, with size changes added up the parent chain, so the cost of an
+ * event depends on the depth of the tree (and the size of the directory it
+ * happens in) rather than the size of the whole tree.
+ *
+ * Anything new is read with the scan's options, so what the scan left out or
+ * pruned stays that way. New and modified files are sized the way the scan
+ * sized them, with hard
+ * links already counted by the scan (in inodes) counted as 0. The scan only
+ * remembers files that already had more than one link, so one first linked
+ * while watching is counted again.
+ *
+ * Only available on Linux, elsewhere Poll never reports any changes.
+ */
+
+class TreeWatcher {
+public:
+  TreeWatcher(FileTree &tree, const ScanOptions &options, InodeSet &inodes);
+  ~TreeWatcher();
+
+  bool IsWatching() const { return m_fd >= 0; }
+
+  // Apply any changes that have happened since the last call. Returns the
+  // directories whose children have changed, which need laying out again.
+  std::vector<node_index_t> Poll();
+
+  // FileTree::Replace, moving the watches below dir over to the new nodes
+  void Replace(node_index_t dir, DirListing &listing);
+
+  // FileTree::Compact, moving the watches over to the new indices
+  std::vector<node_index_t> Compact();
+
+private:
+#ifdef __linux__
+  void AddWatch(node_index_t dir);
+  // Watch every directory from first to the end of the tree
+  void AddWatches(node_index_t first);
+  // Forget the watches for everything below (and including) node
+  void ForgetWatches(node_index_t node);
+
+  void Created(node_index_t dir, const char *name);
+  void Deleted(node_index_t dir, const char *name);
+  // Re-stat files that have been written to
+  void UpdateModified();
+  // Give a node read by File(fs::directory_entry) its size in m_sizes
+  void SizeNode(node_index_t node);
+#endif
+  // New directories are usually small, not worth more than one thread
+  static ScanOptions OneThread(ScanOptions options) {
+    options.num_threads = 1;
+    return options;
+  }
+
+private:
+  FileTree &m_tree;
+  int m_fd;
+  SizeMode m_sizes;
+  InodeSet &m_inodes;
+  // Reads new directories, and has the scan's rules for what to leave out
+  ParallelScanner m_scanner;
+
+  // inotify watch descriptor <-> directory node
+  std::unordered_map<int, node_index_t> m_dirs;
+  std::unordered_map<node_index_t, int> m_watches;
+
+  // Files written to since the last Poll, as (watch, name). A file can get
+  // thousands of IN_MODIFY events, so they are only stat'd once per Poll.
+  std::set<std::pair<int, std::string>> m_modified;
+
+  std::vector<node_index_t> m_changed;
+  bool m_warned_limit;
+};
+
+#ifdef __linux__
+
+TreeWatcher::TreeWatcher(FileTree &tree, const ScanOptions &options,
+                         InodeSet &inodes)
+    : m_tree(tree), m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+      m_sizes(options.sizes), m_inodes(inodes),
+      m_scanner(OneThread(options), &inodes), m_warned_limit(false) {
+  assert(m_tree.IsFullyGrown());
+  if (m_fd < 0) {
+    std::clog << "Warning, unable to watch for changes: "
+              << std::strerror(errno) << '\n';
+    return;
+  }
+  AddWatches(0);
+}
+
+TreeWatcher::~TreeWatcher() {
+  if (m_fd >= 0) { close(m_fd); }
+}
+
+void TreeWatcher::AddWatch(node_index_t dir) {
+  constexpr uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM |
+                            IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW |
+                            IN_EXCL_UNLINK;
+
+  const int wd = inotify_add_watch(m_fd, m_tree.GetPath(dir).c_str(), mask);
+  if (wd < 0) {
+    if (errno == ENOSPC and !m_warned_limit) {
+      std::clog << "Warning, out of inotify watches, some directories won't "
+                   "be updated (see fs.inotify.max_user_watches)\n";
+      m_warned_limit = true;
+    }
+    return;
+  }
+  m_dirs[wd] = dir;
+  m_watches[dir] = wd;
+}
+
+void TreeWatcher::AddWatches(node_index_t first) {
+  for (node_index_t i = first; i < m_tree.Size(); ++i) {
+    if (m_tree.GetFile(i).type == File::DIRECTORY) { AddWatch(i); }
+  }
+}
+
+void TreeWatcher::ForgetWatches(node_index_t node) {
+  std::vector<node_index_t> below = {node};
+  while (!below.empty()) {
+    const node_index_t n = below.back();
+    below.pop_back();
+    for (node_index_t c : m_tree.Children(n)) {
+      below.push_back(c);
+    }
+
+    auto it = m_watches.find(n);
+    if (it != m_watches.end()) {
+      inotify_rm_watch(m_fd, it->second);
+      m_dirs.erase(it->second);
+      m_watches.erase(it);
+    }
+  }
+}
+
+void TreeWatcher::Replace(node_index_t dir, DirListing &listing) {
+  for (node_index_t c : m_tree.Children(dir)) {
+    ForgetWatches(c);
+  }
+  const node_index_t first_new = (node_index_t)m_tree.Size();
+  m_tree.Replace(dir, listing);
+  if (m_fd >= 0) { AddWatches(first_new); }
+}
+
+std::vector<node_index_t> TreeWatcher::Compact() {
+  std::vector<node_index_t> new_index = m_tree.Compact();
+  m_watches.clear();
+  for (auto &[wd, dir] : m_dirs) {
+    // Removed directories have already lost their watch
+    assert(dir == 0 or new_index[dir] != NULL_INDEX);
+    dir = new_index[dir];
+    m_watches[dir] = wd;
+  }
+  return new_index;
+}
+
+std::vector<node_index_t> TreeWatcher::Poll() {
+  m_changed.clear();
+  if (m_fd < 0) { return m_changed; }
+
+  alignas(inotify_event) char buffer[1 << 16];
+  for (;;) {
+    const ssize_t n = read(m_fd, buffer, sizeof(buffer));
+    if (n <= 0) { break; }
+
+    for (ssize_t pos = 0; pos < n;) {
+      const auto *e = reinterpret_cast<const inotify_event *>(buffer + pos);
+      pos += sizeof(inotify_event) + e->len;
+
+      if (e->mask & IN_Q_OVERFLOW) {
+        std::clog << "Warning, too many changes at once, the map may be out "
+                     "of date\n";
+        continue;
+      }
+      if (e->mask & IN_IGNORED) {
+        // The directory has gone, we will have already removed it from its
+        // parent's delete event
+        auto it = m_dirs.find(e->wd);
+        if (it != m_dirs.end()) {
+          m_watches.erase(it->second);
+          m_dirs.erase(it);
+        }
+        continue;
+      }
+
+      auto it = m_dirs.find(e->wd);
+      if (it == m_dirs.end() or e->len == 0) { continue; }
+      const node_index_t dir = it->second;
+
+      if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+        Created(dir, e->name);
+      } else if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        Deleted(dir, e->name);
+      } else if (e->mask & IN_MODIFY) {
+        m_modified.emplace(e->wd, e->name);
+      }
+    }
+  }
+
+  UpdateModified();
+  return m_changed;
+}
+
+void TreeWatcher::Created(node_index_t dir, const char *name) {
+  std::optional<File> found;
+  try {
+    found.emplace(fs::directory_entry(m_tree.GetPath(dir) / name));
+  } catch (const fs::filesystem_error &) {
+    // Already gone again, there will be a delete event to follow
+    return;
+  }
+  File &f = *found;
+
+  // Left out or pruned just as the scan would have. A new directory is on
+  // the same device as its parent, so one_file_system has nothing to prune.
+  unsigned depth = 1;
+  for (node_index_t a = dir; a != 0; a = m_tree.GetFile(a).parent) {
+    ++depth;
+  }
+  if (f.type != File::DIRECTORY) {
+    if (m_scanner.Excluded(name)) { return; }
+  } else if (m_scanner.Prune(depth, name)) {
+    f = File(name, DIR_SIZE, File::PRUNED);
+  }
+
+  // Replaced rather than new, e.g. a file saved by renaming over the old one
+  const node_index_t existing = m_tree.FindChild(dir, name);
+  if (existing != NULL_INDEX) {
+    if (f.type == m_tree.GetFile(existing).type and f.type != File::DIRECTORY) {
+      m_tree.Resize(existing, f.size);
+      SizeNode(existing);
+      m_changed.push_back(dir);
+      return;
+    }
+    Deleted(dir, name);
+  }
+
+  std::vector<std::pair<node_index_t, node_index_t>> moved;
+  const node_index_t added = m_tree.Insert(dir, f, &moved);
+
+  for (auto [from, to] : moved) {
+    auto w = m_watches.find(from);
+    if (w == m_watches.end()) { continue; }
+    const int wd = w->second;
+    m_watches.erase(w);
+    m_watches[to] = wd;
+    m_dirs[wd] = to;
+  }
+
+  if (f.type == File::DIRECTORY) {
+    // Anything created before the watch was added won't get an event, so
+    // watch first then scan whatever is already there
+    AddWatch(added);
+    DirListing &listing = m_scanner.Start(m_tree.GetPath(added), depth);
+    while (!m_scanner.Done()) {
+      std::this_thread::yield();
+    }
+    m_scanner.Stop();
+    Replace(added, listing);
+  }
+  // After Replace, which gives a directory DIR_SIZE of its own again
+  SizeNode(added);
+  m_changed.push_back(dir);
+}
+
+void TreeWatcher::Deleted(node_index_t dir, const char *name) {
+  const node_index_t gone = m_tree.FindChild(dir, name);
+  if (gone == NULL_INDEX) { return; }
+
+  ForgetWatches(gone);
+  m_tree.Remove(gone);
+  m_changed.push_back(dir);
+}
+
+void TreeWatcher::UpdateModified() {
+  for (const auto &[wd, name] : m_modified) {
+    auto it = m_dirs.find(wd);
+    if (it == m_dirs.end()) { continue; }
+
+    const node_index_t dir = it->second;
+    const node_index_t file = m_tree.FindChild(dir, name.c_str());
+    if (file == NULL_INDEX or m_tree.GetFile(file).type != File::REGULAR) {
+      continue;
+    }
+
+    struct stat st;
+    if (lstat(m_tree.GetPath(file).c_str(), &st) != 0) { continue; }
+    // The link a hard-linked file was counted under keeps being counted,
+    // StatSize would give it 0 as its inode has already been seen
+    const uintmax_t old_size = m_tree.GetFile(file).size;
+    const uintmax_t size = m_sizes == SizeMode::ALLOCATED and old_size != 0
+                               ? (uintmax_t)st.st_blocks * 512
+                               : StatSize(st, m_sizes, m_inodes);
+    if (size != old_size) {
+      m_tree.Resize(file, size);
+      m_changed.push_back(dir);
+    }
+  }
+  m_modified.clear();
+}
+
+void TreeWatcher::SizeNode(node_index_t node) {
+  // File(fs::directory_entry) already gives the apparent size, and the scan
+  // doesn't stat PRUNED directories
+  if (m_sizes == SizeMode::APPARENT or
+      m_tree.GetFile(node).type == File::PRUNED) {
+    return;
+  }
+
+  struct stat st;
+  if (lstat(m_tree.GetPath(node).c_str(), &st) != 0) { return; }
+  const FileNode f = m_tree.GetFile(node);
+  // A directory's size includes its children's
+  const uintmax_t own = f.type == File::DIRECTORY ? DIR_SIZE : f.size;
+  m_tree.Resize(node, f.size - own + StatSize(st, m_sizes, m_inodes));
+}
+
+#else
+
+TreeWatcher::TreeWatcher(FileTree &tree, const ScanOptions &options,
+                         InodeSet &inodes)
+    : m_tree(tree), m_fd(-1), m_sizes(options.sizes), m_inodes(inodes),
+      m_scanner(OneThread(options), &inodes), m_warned_limit(false) {
+  std::clog << "Warning, watching for changes is only supported on Linux\n";
+}
+
+TreeWatcher::~TreeWatcher() {}
+
+std::vector<node_index_t> TreeWatcher::Poll() { return m_changed; }
+
+std::vector<node_index_t> TreeWatcher::Compact() { return m_tree.Compact(); }
+
+void TreeWatcher::Replace(node_index_t dir, DirListing &listing) {
+  m_tree.Replace(dir, listing);
+}
+
+#endif
@@ -1,17 +1,56 @@
 #include "SDL.h"
+#include "attributes.h"
 #include "backends/imgui_impl_sdl2.h"
 #include "backends/imgui_impl_sdlrenderer2.h"
 #include "filemap.h"
 #include "filetree.h"
 #include "imgui.h"
+#include "scanner.h"
+#include "search.h"
+#include "stats.h"
+#include "tilecache.h"
+#include "watcher.h"
 
+#include <cmath>
 #include <cstdlib>
 #include <filesystem>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <unordered_set>
 #include <vector>
 
 namespace fs = std::filesystem;
 
 constexpr int NUM_COLOURS = 12;
+// Directories, when colouring by an attribute, which only files have. Also
+// anything in a diff with no change overall.
+constexpr SDL_Colour DIRECTORY_COLOUR = {0x40, 0x40, 0x40, 0x00};
+// Nodes of a diff that grew and shrank overall
+constexpr SDL_Colour GROWN_COLOUR = {0xd0, 0x40, 0x30, 0x00};
+constexpr SDL_Colour SHRUNK_COLOUR = {0x30, 0xa0, 0x50, 0x00};
+// Colours after the palette, see App::Colour
+constexpr SDL_Colour EXTRA_COLOURS[] = {DIRECTORY_COLOUR, GROWN_COLOUR,
+                                        SHRUNK_COLOUR};
+constexpr int NUM_BATCH_COLOURS = NUM_COLOURS + 3;
+// Most rows in the breakdown table
+constexpr std::size_t MAX_BREAKDOWN_ROWS = 30;
+
+// While the tree is still growing, how often to redo the layout
+constexpr Uint32 MIN_LAYOUT_INTERVAL_MS = 250;
+// Most nodes to add to a growing tree per layout
+constexpr std::size_t MAX_NODES_PER_LAYOUT = 1 << 20;
+// Most tiles to draw per frame, the rest are stretched from a lower zoom
+// level until they are drawn
+constexpr int MAX_TILES_PER_FRAME = 16;
+// Frames to draw after anything changes, as ImGui can take a couple to settle
+// e.g. when a window first sizes itself to its contents
+constexpr int FRAMES_AFTER_CHANGE = 2;
+// How often to wake up with nothing else happening, to poll the watcher or
+// blink the cursor of a text box
+constexpr Uint32 IDLE_POLL_MS = 250;
+constexpr float MIN_ZOOM = 0.1f;
+constexpr float MAX_ZOOM = 4096.0f;
 using Palette = SDL_Colour[NUM_COLOURS];
 
 static Palette default_palette{
@@ -23,59 +62,163 @@ static Palette default_palette{
     {0x98, 0x1c, 0xe0, 0x00}, {0xff, 0x74, 0xc5, 0x00},
 };
 
-std::vector<SDL_FRect> MakeRects(const FileTree &tree, SDL_FRect space) {
-  std::vector<SDL_FRect> rects = {space};
-
-  for (node_index_t rect = 0; rect < tree.Size(); ++rect) {
-    if (tree.GetFile(rect).type != File::DIRECTORY) {
-      continue;
-    }
-
-    RowLayoutManager row_man(rects[rect], tree.GetFile(rect).size, rects);
-
-    const node_index_t c0 = tree.GetFile(rect).first_child;
-    if (c0 == NULL_INDEX) {
-      continue;
-    }
-    // if c0 != NULL_INDEX then CountChildren >= 1 is guaranteed
-    const node_index_t c1 = c0 + tree.CountChildren(rect) - 1;
-    for (node_index_t i = c0; i <= c1; ++i) {
-      row_man.Add(tree.GetFile(i).size);
-    }
-  }
-
-  return rects;
-}
-
 class App {
 public:
   App(const char *name, int width, int height);
 
-  void SetTarget(FileTree *, SDL_FRect *);
+  // The tree may still be growing, see FileTree::GrowFrom
+  void SetTarget(FileTree *);
+  // Keep the map up to date with changes to the filesystem, once the tree
+  // has finished growing
+  void Watch(bool enabled) { m_watch = enabled; }
+  // Directories smaller than this many pixels on screen are drawn as one
+  // rect, without laying out their contents
+  void SetDetail(float min_pixels) { m_min_pixels = min_pixels; }
+  // Colour the map by whether each node grew or shrank, for a tree made by
+  // DiffTrees. Call after SetTarget.
+  void ShowDiff(const std::vector<intmax_t> *delta) { m_delta = delta; }
+  // Show the stats overlay, which can also be toggled with F1
+  void ShowStats(bool show);
+  // Show the search box, which can also be toggled with Ctrl+F
+  void ShowSearch(bool show) { m_show_search = show; }
+  // Show the breakdown by attribute below the focus (right click to move
+  // it), which can also be toggled with F2
+  void ShowBreakdown(bool show) { m_show_breakdown = show; }
   void SetPalette(Palette);
+  // How to read directories that are rescanned or watched, and the hard links
+  // the scan has already counted
+  void SetScanOptions(const ScanOptions &options, InodeSet &inodes) {
+    m_scan_options = options;
+    m_inodes = &inodes;
+  }
 
   void Run();
   bool IsRunning() const { return m_alive; }
   void Quit() { m_alive = false; }
 
 private:
+  // Block until there is an event, or until background work (a growing tree,
+  // the watcher, tiles left to draw) needs another look
+  void WaitForWork();
   void ProcessEvents();
+  // Draw the next FRAMES_AFTER_CHANGE frames, rather than waiting for input
+  void Redraw() { m_redraw = FRAMES_AFTER_CHANGE; }
+  void DrawFrame();
 
-  void UpdateMapTexture();
+  // Pick up new nodes from a growing tree and redo the layout
+  void Relayout();
+  // Lay out whatever has come into view after panning or zooming, or start
+  // again if rebuild is set
+  void LayoutView(bool rebuild);
+  // The part of the map on screen, in layout coordinates
+  SDL_FRect VisibleArea() const;
+  // Redo the layout below directories that have changed
+  void RelayoutChanged(const std::vector<node_index_t> &dirs);
+  // Compact the tree once changes have left it mostly garbage, see
+  // FileTree::NeedsCompacting
+  void CompactIfNeeded();
+  // Start again after the tree has been compacted, keeping the selection and
+  // focus
+  void Renumber(const std::vector<node_index_t> &new_index);
+  // Read a directory from disk again, replacing what was below it, e.g. after
+  // deleting something big. If it has gone its nearest ancestor is rescanned.
+  // The scan runs in the background, one at a time, see FinishRescan.
+  void Rescan(node_index_t dir);
+  // Put a finished rescan into the tree
+  void FinishRescan();
+  // The selected node, or the ancestor of it that scrolling has moved to
+  node_index_t SelectedAncestor();
+  // Zoom level of the tiles to draw, see TileCache
+  int ZoomLevel() const;
+  // The tiles that cover area at a zoom level, as [x0, x1) x [y0, y1)
+  void TileRange(SDL_FRect area, int level, int &x0, int &y0, int &x1,
+                 int &y1) const;
+  // Draw any missing tiles that are on screen, up to MAX_TILES_PER_FRAME
+  void UpdateTiles();
+  void DrawTile(TileKey key, SDL_Texture *target);
+  // Is a directory drawn over by its children, apart from less than a pixel
+  bool IsCovered(node_index_t dir, const SDL_FRect &rect, float scale) const;
+  void DrawMap();
+  void DrawStats();
+  // Run the search in the search box again, e.g. after the tree changes
+  void Search();
+  void DrawSearch();
+  // Shade the search matches on screen. Matches too small to have been laid
+  // out shade the smallest directory around them that has been. The rects are
+  // only found again after the view, layout or matches change.
+  void HighlightMatches();
   void HighlightRect(node_index_t);
+  // Total up the focus again if it's out of date and anything shows it
+  void UpdateBreakdown();
+  // Rank the values of the attribute the map is coloured by, clearing the
+  // tiles if any colours change
+  void UpdateColours();
+  void DrawBreakdown();
+  // Palette index of a node, or NUM_COLOURS + i for EXTRA_COLOURS[i]
+  int Colour(node_index_t node) const;
 
 public:
   SDL_Window *window;
   SDL_Renderer *renderer;
-  SDL_Texture *screen;
 
   SDL_Colour clear_colour;
 
 private:
   bool m_alive;
+  // Frames left to draw before waiting for something to change, see Redraw
+  int m_redraw;
+  // Tiles on screen that UpdateTiles didn't get to
+  bool m_tiles_pending;
 
   FileTree *m_tree;
-  SDL_FRect *m_rects;
+  SDL_FRect m_map_space;
+  TreeLayout m_layout;
+  float m_min_pixels;
+  // Zoom level and size of the layout when it was last built from scratch
+  int m_layout_level;
+  std::size_t m_built_count;
+  bool m_view_changed;
+  bool m_show_stats;
+  bool m_show_search;
+  TileCache m_tiles;
+  // Rects to draw in a tile, by depth then colour, kept between tiles
+  std::vector<std::vector<SDL_FRect>> m_batches;
+
+  NameIndex m_search_index;
+  char m_search_text[256];
+  SearchResult m_search;
+  // The largest few matches, to list
+  std::vector<node_index_t> m_search_top;
+  std::vector<SDL_FRect> m_search_rects;
+  bool m_search_rects_stale;
+
+  bool m_show_breakdown;
+  // Totals below m_focus, see attributes.h
+  node_index_t m_focus;
+  Breakdown m_breakdown;
+  bool m_breakdown_stale;
+  Attribute m_breakdown_attribute;
+  // Colour files by m_breakdown_attribute rather than at random
+  bool m_colour_by_attribute;
+  // Attribute id -> palette index, the largest NUM_COLOURS - 1 values below
+  // the focus get their own colour and the rest share the last. Empty when
+  // not colouring by attribute.
+  std::vector<uint8_t> m_attribute_colours;
+  // Change of each node, if the tree is a diff
+  const std::vector<intmax_t> *m_delta;
+
+  // Layout is throttled while the tree grows, see Relayout
+  Uint32 m_last_layout;
+  Uint32 m_layout_interval;
+
+  bool m_watch;
+  std::unique_ptr<TreeWatcher> m_watcher;
+  ScanOptions m_scan_options;
+  InodeSet *m_inodes;
+  // The Rescan in progress, if any, and the directory it replaces
+  std::unique_ptr<ParallelScanner> m_rescanner;
+  DirListing *m_rescan_listing;
+  node_index_t m_rescan_dir;
 
   float m_zoom;
   SDL_FPoint m_offset;
@@ -85,22 +228,36 @@ private:
   const int m_selected_rect_thickness = 3;
   node_index_t m_selected = 0;
   int m_selected_parent_depth = 0;
+  // Path of the node the tooltip was last shown for, which only needs
+  // building again when the mouse moves to another
+  node_index_t m_tooltip_node;
+  std::string m_tooltip_path;
 };
 
 App::App(const char *name, int width, int height)
     : window(SDL_CreateWindow(name, 10, 30, width, height, 0)),
       renderer(SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC)),
-      screen(SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888,
-                               SDL_TEXTUREACCESS_TARGET, width, height)),
       clear_colour({0, 0, 0, 0}),
 
-      m_alive(true),
+      m_alive(true), m_redraw(FRAMES_AFTER_CHANGE), m_tiles_pending(false),
 
-      m_tree(nullptr), m_rects(nullptr),
+      m_tree(nullptr), m_map_space{0, 0, (float)width, (float)height},
+      m_layout(), m_min_pixels(1), m_layout_level(0), m_built_count(0),
+      m_view_changed(false), m_show_stats(false), m_show_search(false),
+      m_tiles(renderer), m_batches(), m_search_index(), m_search_text(),
+      m_search(), m_search_top(), m_search_rects(),
+      m_search_rects_stale(true), m_show_breakdown(false),
+      m_focus(0), m_breakdown(), m_breakdown_stale(true),
+      m_breakdown_attribute(Attribute::EXTENSION),
+      m_colour_by_attribute(false), m_attribute_colours(), m_delta(nullptr),
+      m_last_layout(0), m_layout_interval(MIN_LAYOUT_INTERVAL_MS),
+      m_watch(false), m_watcher(nullptr), m_scan_options(), m_inodes(nullptr),
+      m_rescanner(nullptr), m_rescan_listing(nullptr), m_rescan_dir(0),
 
       m_zoom(1), m_offset{0, 0}, m_palette(),
 
-      m_selected(0), m_selected_parent_depth(0) {
+      m_selected(0), m_selected_parent_depth(0), m_tooltip_node(NULL_INDEX),
+      m_tooltip_path() {
   if (window == nullptr) {
     printf("Unable to create window: %s\n", SDL_GetError());
     assert(0);
@@ -113,10 +270,6 @@ App::App(const char *name, int width, int height)
     printf("Unable to create renderer: %s\n", SDL_GetError());
     assert(0);
   }
-  if (screen == nullptr) {
-    printf("Unable to create screen texture: %s\n", SDL_GetError());
-    assert(0);
-  }
 
   // Setup ImGui
   IMGUI_CHECKVERSION();
@@ -140,100 +293,319 @@ void App::SetPalette(Palette p) {
   }
 }
 
-void App::SetTarget(FileTree *tree, SDL_FRect *rects) {
+void App::SetTarget(FileTree *tree) {
   m_tree = tree;
-  m_rects = rects;
+  m_layout = TreeLayout(tree);
+  m_tiles.Clear();
+  m_search_index = NameIndex(tree);
+  m_search = {};
+  m_search_top.clear();
+  m_focus = 0;
+  m_breakdown = {};
+  m_breakdown_stale = true;
+  m_attribute_colours.clear();
+  m_delta = nullptr;
+  m_watcher.reset();
+  m_rescanner.reset();
+  m_tooltip_node = NULL_INDEX;
+  Redraw();
+}
+
+void App::Relayout() {
+  const Uint32 start = SDL_GetTicks();
+
+  m_tree->GrowReady(MAX_NODES_PER_LAYOUT);
+  // Index names as they arrive rather than all at the end
+  m_search_index.Update();
+  if (m_search_text[0]) { Search(); }
+  m_breakdown_stale = true;
+  LayoutView(true);
+  m_tiles.Clear();
+  m_tooltip_node = NULL_INDEX;
+  Redraw();
+
+  // Big trees take a while to lay out, don't spend all our time doing it
+  m_last_layout = SDL_GetTicks();
+  m_layout_interval =
+      std::max(MIN_LAYOUT_INTERVAL_MS, 4 * (m_last_layout - start));
+}
+
+void App::LayoutView(bool rebuild) {
+  // Lay out everything the tiles on screen need, so they are complete when
+  // they are drawn
+  const int level = ZoomLevel();
+  int x0, y0, x1, y1;
+  TileRange(VisibleArea(), level, x0, y0, x1, y1);
+  const SDL_FRect first = TileCache::Area({level, x0, y0});
+  const SDL_FRect view = {first.x, first.y, (x1 - x0) * first.w,
+                          (y1 - y0) * first.h};
+  const float min_size = m_min_pixels / TileCache::Scale(level);
+  m_search_rects_stale = true;
+
+  // Zoomed out, or lots of detail left over from places we have panned away
+  // from, so the layout has more in it than is needed
+  if (rebuild or level < m_layout_level or
+      m_layout.Count() > 4 * m_built_count) {
+    m_layout.Build(m_map_space, view, min_size);
+    m_layout_level = level;
+    m_built_count = m_layout.Count();
+  } else {
+    m_layout.Refine(view, min_size);
+  }
+}
+
+SDL_FRect App::VisibleArea() const {
+  int w, h;
+  SDL_GetWindowSize(window, &w, &h);
+  return {(-(1 - m_zoom) * w / 2 - m_offset.x) / m_zoom,
+          (-(1 - m_zoom) * h / 2 - m_offset.y) / m_zoom, w / m_zoom,
+          h / m_zoom};
+}
+
+void App::RelayoutChanged(const std::vector<node_index_t> &dirs) {
+  std::unordered_set<node_index_t> changed(dirs.begin(), dirs.end());
+  for (node_index_t d : changed) {
+    if (m_tree->GetFile(d).type != File::DIRECTORY) { continue; }
+
+    // Skip anything that is inside another changed directory
+    bool covered = false;
+    for (node_index_t a = d; a != NULL_INDEX and !covered;) {
+      a = m_tree->GetFile(a).parent;
+      covered = changed.count(a) != 0;
+    }
+    if (!covered) {
+      m_tiles.Invalidate(m_layout.GetRect(d));
+      m_layout.Relayout(d);
+    }
+    // Children may have been renamed in place
+    m_search_index.Refresh(m_tree->Children(d));
+  }
+  if (m_search_text[0]) { Search(); }
+
+  if (m_tree->GetFile(m_selected).type == File::EMPTY) { m_selected = 0; }
+  if (m_tree->GetFile(m_focus).type != File::DIRECTORY) { m_focus = 0; }
+  m_breakdown_stale = true;
+  m_search_rects_stale = true;
+  m_tooltip_node = NULL_INDEX;
+  Redraw();
+}
+
+void App::CompactIfNeeded() {
+  if (!m_tree->NeedsCompacting()) { return; }
+  Renumber(m_watcher ? m_watcher->Compact() : m_tree->Compact());
+}
+
+void App::Renumber(const std::vector<node_index_t> &new_index) {
+  // Anything that has gone maps to NULL_INDEX, which is the root
+  m_selected = new_index[m_selected];
+  m_focus = new_index[m_focus];
+  m_layout = TreeLayout(m_tree);
+  m_search_index = NameIndex(m_tree);
+  Relayout();
+}
+
+void App::Rescan(node_index_t dir) {
+  // Nodes only stay put once the tree has finished growing, and a diff isn't
+  // of anything on disk
+  if (!m_tree->IsFullyGrown() or m_delta or m_rescanner) { return; }
+
+  if (m_tree->GetFile(dir).type != File::DIRECTORY) {
+    dir = m_tree->GetFile(dir).parent;
+  }
+  std::error_code ec;
+  while (dir != 0 and !fs::is_directory(m_tree->GetPath(dir), ec)) {
+    dir = m_tree->GetFile(dir).parent;
+  }
+
+  // max_depth still counts from the root
+  unsigned depth = 0;
+  for (node_index_t a = dir; a != 0; a = m_tree->GetFile(a).parent) {
+    ++depth;
+  }
+  m_rescanner = std::make_unique<ParallelScanner>(m_scan_options);
+  m_rescan_listing = &m_rescanner->Start(m_tree->GetPath(dir), depth);
+  m_rescan_dir = dir;
+}
+
+void App::FinishRescan() {
+  m_rescanner->Stop();
+  if (m_watcher) {
+    m_watcher->Replace(m_rescan_dir, *m_rescan_listing);
+  } else {
+    m_tree->Replace(m_rescan_dir, *m_rescan_listing);
+  }
+  // The listings belong to the scanner
+  m_rescanner.reset();
+  m_rescan_listing = nullptr;
+
+  RelayoutChanged({m_rescan_dir});
+  CompactIfNeeded();
+}
+
+node_index_t App::SelectedAncestor() {
+  node_index_t ancestor = m_selected;
+  int i;
+  for (i = 0; i < m_selected_parent_depth; ++i) {
+    if (m_tree->GetFile(ancestor).parent == NULL_INDEX) { break; }
+    ancestor = m_tree->GetFile(ancestor).parent;
+  }
+  m_selected_parent_depth = i;
+  return ancestor;
 }
 
 void App::Run() {
-  UpdateMapTexture();
+  Relayout();
 
   while (m_alive) {
+    WaitForWork();
     ProcessEvents();
 
-    node_index_t ancestor;
-    if (m_selected) {
-      ancestor = m_selected;
-      int i;
-      for (i = 0; i < m_selected_parent_depth; ++i) {
-        if (m_tree->GetFile(ancestor).parent == NULL_INDEX) {
-          break;
-        }
-        ancestor = m_tree->GetFile(ancestor).parent;
+    if (m_view_changed) {
+      m_view_changed = false;
+      LayoutView(false);
+    }
+    UpdateTiles();
+
+    if (!m_tree->IsFullyGrown() and
+        SDL_GetTicks() - m_last_layout >= m_layout_interval) {
+      Relayout();
+    }
+
+    if (m_rescanner and m_rescanner->Done()) { FinishRescan(); }
+    // The watcher moves nodes around, so waits for any rescan to finish
+    if (m_watch and m_tree->IsFullyGrown() and !m_rescanner) {
+      if (!m_watcher) {
+        assert(m_inodes != nullptr);
+        m_watcher =
+            std::make_unique<TreeWatcher>(*m_tree, m_scan_options, *m_inodes);
+      }
+      const std::vector<node_index_t> changed = m_watcher->Poll();
+      if (!changed.empty()) {
+        RelayoutChanged(changed);
+        CompactIfNeeded();
       }
-      m_selected_parent_depth = i;
     }
+    UpdateBreakdown();
 
-    // Start new drawing frame
-    auto [r, g, b, a] = clear_colour;
-    SDL_SetRenderDrawColor(renderer, r, g, b, a);
-    SDL_RenderClear(renderer);
+    // Nothing has changed on screen
+    if (m_redraw == 0) { continue; }
+    --m_redraw;
+    DrawFrame();
+  }
+}
 
-    ImGui_ImplSDLRenderer2_NewFrame();
-    ImGui_ImplSDL2_NewFrame();
-    ImGui::NewFrame();
+void App::WaitForWork() {
+  if (m_redraw > 0 or m_tiles_pending or m_view_changed) { return; }
 
-    // Draw to base 'screen' layer
-    int w, h;
-    SDL_GetWindowSize(window, &w, &h);
-    SDL_SetRenderTarget(renderer, NULL);
-    SDL_Rect d = {(int)((1 - m_zoom) * w / 2 + m_offset.x),
-                  (int)((1 - m_zoom) * h / 2 + m_offset.y), (int)(w * m_zoom),
-                  (int)(h * m_zoom)};
+  // Forever, unless something in the background needs checking on
+  Uint32 timeout = UINT32_MAX;
+  if (!m_tree->IsFullyGrown()) {
+    const Uint32 since = SDL_GetTicks() - m_last_layout;
+    timeout = since < m_layout_interval ? m_layout_interval - since : 0;
+  }
+  if (m_watch or m_rescanner or ImGui::GetIO().WantTextInput) {
+    timeout = std::min(timeout, IDLE_POLL_MS);
+  }
+
+  if (timeout == UINT32_MAX) {
+    SDL_WaitEvent(nullptr);
+  } else if (timeout > 0) {
+    SDL_WaitEventTimeout(nullptr, (int)timeout);
+  }
+  // The cursor of a text box blinks
+  if (ImGui::GetIO().WantTextInput) { Redraw(); }
+}
+
+void App::DrawFrame() {
+  PhaseTimer frame_timer(Phase::FRAME);
+  const node_index_t ancestor = SelectedAncestor();
+
+  // Start new drawing frame
+  auto [r, g, b, a] = clear_colour;
+  SDL_SetRenderDrawColor(renderer, r, g, b, a);
+  SDL_RenderClear(renderer);
+
+  ImGui_ImplSDLRenderer2_NewFrame();
+  ImGui_ImplSDL2_NewFrame();
+  ImGui::NewFrame();
+
+  DrawMap();
+
+  // Draw on top of the map
+  if (!m_search.matches.empty()) { HighlightMatches(); }
+  if (m_selected) {
+    HighlightRect(ancestor);
+  }
 
-    SDL_RenderCopy(renderer, screen, NULL, &d);
+  // Do all ImGui drawing
+  if (!m_tree->IsFullyGrown()) {
+    ImGui::SetNextWindowPos({10.0f, 10.0f});
+    ImGui::SetNextWindowBgAlpha(0.5f);
+    ImGui::Begin("Scanning", nullptr,
+                 ImGuiWindowFlags_NoDecoration |
+                     ImGuiWindowFlags_AlwaysAutoResize |
+                     ImGuiWindowFlags_NoSavedSettings |
+                     ImGuiWindowFlags_NoFocusOnAppearing |
+                     ImGuiWindowFlags_NoNav);
+    ImGui::Text("Scanning... %zu files", m_tree->Size());
+    ImGui::End();
+  }
+  if (m_show_stats) { DrawStats(); }
+  if (m_show_search) { DrawSearch(); }
+  if (m_show_breakdown) { DrawBreakdown(); }
 
-    // Draw on top of 'screen'
-    if (m_selected) {
-      HighlightRect(ancestor);
+  if (m_selected) {
+    const FileNode anc = m_tree->GetFile(ancestor);
+    if (ancestor != m_tooltip_node) {
+      m_tooltip_node = ancestor;
+      m_tooltip_path = m_tree->GetPath(ancestor).string();
     }
+    const char *p = m_tooltip_path.c_str();
 
-    // Do all ImGui drawing
-    if (m_selected) {
-      const FileNode &anc = m_tree->GetFile(ancestor);
-      fs::path p;
-      if (anc.type != File::DIRECTORY and anc.parent != NULL_INDEX) {
-        const FileNode &par = m_tree->GetFile(anc.parent);
-        p = (par.path / anc.path);
-      } else {
-        p = anc.path;
-      }
+    {
+      int w, h, x, y;
+      SDL_GetWindowSize(window, &w, &h);
+      SDL_GetMouseState(&x, &y);
 
-      {
-        int w, h, x, y;
-        SDL_GetWindowSize(window, &w, &h);
-        SDL_GetMouseState(&x, &y);
+      float ux = ImGui::CalcTextSize(p, NULL, false, (float)(w - x)).x;
 
-        float ux =
-            ImGui::CalcTextSize(p.string().c_str(), NULL, false, (float)(w - x))
-                .x;
+      int prefix = 0;
+      double size = (double)anc.size;
+      while (size > 1024) {
+        size /= 1024;
+        ++prefix;
+      }
+      assert(prefix < 7);
+      char unit_prefix = " KMGTPE"[prefix];
 
-        int prefix = 0;
-        double size = (double)anc.size;
-        while (size > 1024) {
-          size /= 1024;
-          ++prefix;
+      float px = ImGui::GetStyle().WindowPadding.x;
+      ImGui::SetNextWindowSize({ux + 2 * px, 0.0f});
+      ImGui::BeginTooltip();
+      ImGui::TextWrapped("%s\n%.2f %cB\n", p, size, unit_prefix);
+      if (anc.type == File::PRUNED) {
+        ImGui::TextUnformatted("not scanned");
+      }
+      if (m_delta) {
+        // The size is how much changed, this is which way
+        const intmax_t delta = (*m_delta)[ancestor];
+        if (delta == 0) {
+          ImGui::TextUnformatted("no change overall");
+        } else {
+          ImGui::Text("%s by %s", delta > 0 ? "grew" : "shrank",
+                      FormatSize((uintmax_t)std::abs(delta)).str().c_str());
         }
-        assert(prefix < 7);
-        char unit_prefix = " KMGTPE"[prefix];
-
-        float px = ImGui::GetStyle().WindowPadding.x;
-        ImGui::SetNextWindowSize({ux + 2 * px, 0.0f});
-        ImGui::BeginTooltip();
-        ImGui::TextWrapped("%s\n%.2f %cB\n", p.string().c_str(), size,
-                           unit_prefix);
-        ImGui::EndTooltip();
       }
+      ImGui::EndTooltip();
     }
-
-    // Present new frame
-    ImGui::Render();
-    ImGuiIO &io = ImGui::GetIO();
-    SDL_RenderSetScale(renderer, io.DisplayFramebufferScale.x,
-                       io.DisplayFramebufferScale.y);
-    ImGui_ImplSDLRenderer2_RenderDrawData(ImGui::GetDrawData());
-    SDL_RenderPresent(renderer);
   }
+
+  // Present new frame
+  ImGui::Render();
+  ImGuiIO &io = ImGui::GetIO();
+  SDL_RenderSetScale(renderer, io.DisplayFramebufferScale.x,
+                     io.DisplayFramebufferScale.y);
+  ImGui_ImplSDLRenderer2_RenderDrawData(ImGui::GetDrawData());
+  SDL_RenderPresent(renderer);
 }
 
 void App::ProcessEvents() {
@@ -243,6 +615,8 @@ void App::ProcessEvents() {
   SDL_Event e;
 
   while (SDL_PollEvent(&e)) {
+    // Anything could have changed, if only ImGui's hover highlights
+    Redraw();
     ImGui_ImplSDL2_ProcessEvent(&e);
     key_stolen = (e.type == SDL_KEYDOWN or e.type == SDL_KEYUP) and
                  io.WantCaptureKeyboard;
@@ -263,6 +637,22 @@ void App::ProcessEvents() {
       case SDLK_ESCAPE: {
         App::Quit();
       } break; // SDLK_ESCAPE
+
+      case SDLK_F1: {
+        ShowStats(!m_show_stats);
+      } break; // SDLK_F1
+
+      case SDLK_F2: {
+        ShowBreakdown(!m_show_breakdown);
+      } break; // SDLK_F2
+
+      case SDLK_F5: {
+        Rescan(SelectedAncestor());
+      } break; // SDLK_F5
+
+      case SDLK_f: {
+        if (e.key.keysym.mod & KMOD_CTRL) { ShowSearch(!m_show_search); }
+      } break; // SDLK_f
       }
 
     } break; // SDL_KEYDOWN
@@ -271,25 +661,16 @@ void App::ProcessEvents() {
     } break; // SDL_MOUSEBUTTONDOWN
 
     case SDL_MOUSEBUTTONUP: {
-      node_index_t ancestor;
-      if (m_selected) {
-        ancestor = m_selected;
-        int i;
-        for (i = 0; i < m_selected_parent_depth; ++i) {
-          if (m_tree->GetFile(ancestor).parent == NULL_INDEX) {
-            break;
-          }
-          ancestor = m_tree->GetFile(ancestor).parent;
+      if (e.button.button == SDL_BUTTON_RIGHT) {
+        node_index_t focus = SelectedAncestor();
+        if (m_tree->GetFile(focus).type != File::DIRECTORY) {
+          focus = m_tree->GetFile(focus).parent;
         }
-        m_selected_parent_depth = i;
-      }
-      const FileNode &fn = m_tree->GetFile(ancestor);
-      fs::path p;
-      if (!fn.parent or fn.type == File::DIRECTORY) {
-        p = fn.path;
-      } else {
-        p = m_tree->GetFile(fn.parent).path / fn.path;
+        m_breakdown_stale = m_breakdown_stale or focus != m_focus;
+        m_focus = focus;
+        break;
       }
+      const fs::path p = m_tree->GetPath(SelectedAncestor());
 
       std::cout << '"' << std::string(p) << '"' << '\n';
     } break; // SDL_MOUSEBUTTONUP
@@ -298,12 +679,14 @@ void App::ProcessEvents() {
       if (SDL_BUTTON_LMASK & e.motion.state) {
         m_offset.x += e.motion.xrel;
         m_offset.y += e.motion.yrel;
+        m_view_changed = true;
 
       } else {
         int w, h;
         SDL_GetWindowSize(window, &w, &h);
+        PhaseTimer timer(Phase::HIT_TEST);
         node_index_t new_selected = FindMouseClick(
-            m_tree, m_rects,
+            m_layout,
             (e.motion.x - (1 - m_zoom) * w / 2 - m_offset.x) / m_zoom,
             (e.motion.y - (1 - m_zoom) * h / 2 - m_offset.y) / m_zoom);
         if (new_selected != m_selected) {
@@ -318,12 +701,13 @@ void App::ProcessEvents() {
         int w, h;
         SDL_GetWindowSize(window, &w, &h);
         float new_zoom = m_zoom * std::pow(0.9, -e.wheel.preciseY);
-        new_zoom = std::clamp(new_zoom, 0.1f - m_zoom, 10.0f - m_zoom);
+        new_zoom = std::clamp(new_zoom, MIN_ZOOM, MAX_ZOOM);
         float scale = (new_zoom - m_zoom) / m_zoom;
         m_offset.x += scale * m_offset.x;
         m_offset.y += scale * m_offset.y;
 
         m_zoom = new_zoom;
+        m_view_changed = true;
       } else {
         m_selected_parent_depth -= e.wheel.y;
         m_selected_parent_depth = std::max(0, m_selected_parent_depth);
@@ -335,20 +719,296 @@ void App::ProcessEvents() {
   }
 }
 
-void App::UpdateMapTexture() {
-  SDL_SetRenderTarget(renderer, screen);
+int App::ZoomLevel() const {
+  return std::max(0, (int)std::ceil(std::log2(m_zoom)));
+}
+
+void App::TileRange(SDL_FRect area, int level, int &x0, int &y0, int &x1,
+                    int &y1) const {
+  // Nothing to draw outside of the map
+  const float side = TileCache::Area({level, 0, 0}).w;
+  const int nx = (int)std::ceil(m_map_space.w / side);
+  const int ny = (int)std::ceil(m_map_space.h / side);
+
+  x0 = std::clamp((int)std::floor(area.x / side), 0, nx);
+  y0 = std::clamp((int)std::floor(area.y / side), 0, ny);
+  x1 = std::clamp((int)std::ceil((area.x + area.w) / side), x0, nx);
+  y1 = std::clamp((int)std::ceil((area.y + area.h) / side), y0, ny);
+}
+
+void App::UpdateTiles() {
+  const int level = ZoomLevel();
+  int x0, y0, x1, y1;
+  TileRange(VisibleArea(), level, x0, y0, x1, y1);
+
+  int drawn = 0;
+  m_tiles_pending = false;
+  for (int y = y0; y < y1 and !m_tiles_pending; ++y) {
+    for (int x = x0; x < x1; ++x) {
+      if (m_tiles.Get({level, x, y})) { continue; }
+      // The rest are drawn on the next frames
+      if (drawn == MAX_TILES_PER_FRAME) {
+        m_tiles_pending = true;
+        break;
+      }
+      SDL_Texture *target = m_tiles.Add({level, x, y});
+      if (target) { DrawTile({level, x, y}, target); }
+      ++drawn;
+    }
+  }
+  if (drawn > 0) { Redraw(); }
+}
+
+void App::DrawTile(TileKey key, SDL_Texture *target) {
+  PhaseTimer timer(Phase::DRAW_TILES);
+  Stats::Count(Counter::TILES_DRAWN);
+  const SDL_FRect area = TileCache::Area(key);
+  const float scale = TileCache::Scale(key.level);
+  const float min_size = m_min_pixels / scale;
+
+  // Rects at the same depth never overlap so can be drawn in any order,
+  // which lets each depth be drawn with one call per colour
+  for (std::vector<SDL_FRect> &batch : m_batches) {
+    batch.clear();
+  }
+  m_layout.ForEachIn(
+      area, min_size, [&](node_index_t node, const SDL_FRect &rect, int depth) {
+        if (rect.w >= min_size and rect.h >= min_size and
+            IsCovered(node, rect, scale)) {
+          return;
+        }
+
+        // Only the part inside the tile
+        const float x0 = std::max(rect.x, area.x);
+        const float y0 = std::max(rect.y, area.y);
+        const float x1 = std::min(rect.x + rect.w, area.x + area.w);
+        const float y1 = std::min(rect.y + rect.h, area.y + area.h);
+
+        const std::size_t b =
+            (std::size_t)depth * NUM_BATCH_COLOURS + Colour(node);
+        if (b >= m_batches.size()) { m_batches.resize(b + 1); }
+        m_batches[b].push_back({(x0 - area.x) * scale, (y0 - area.y) * scale,
+                                (x1 - x0) * scale, (y1 - y0) * scale});
+      });
+
+  SDL_SetRenderTarget(renderer, target);
+  auto [r, g, b, a] = clear_colour;
+  SDL_SetRenderDrawColor(renderer, r, g, b, a);
+  SDL_RenderClear(renderer);
 
-  for (node_index_t i = 0; i < m_tree->Size(); ++i) {
-    SDL_Colour c = m_palette[i % NUM_COLOURS];
+  for (std::size_t i = 0; i < m_batches.size(); ++i) {
+    if (m_batches[i].empty()) { continue; }
+    const int colour = (int)(i % NUM_BATCH_COLOURS);
+    SDL_Colour c = colour < NUM_COLOURS ? m_palette[colour]
+                                        : EXTRA_COLOURS[colour - NUM_COLOURS];
     SDL_SetRenderDrawColor(renderer, c.r, c.g, c.b, c.a);
-    SDL_RenderFillRectF(renderer, &(m_rects[i]));
+    SDL_RenderFillRectsF(renderer, m_batches[i].data(),
+                         (int)m_batches[i].size());
   }
   SDL_SetRenderTarget(renderer, NULL);
 }
 
+int App::Colour(node_index_t node) const {
+  const File::Type type = m_tree->Types()[node];
+  if (m_attribute_colours.empty() and m_delta) {
+    const intmax_t delta = (*m_delta)[node];
+    return NUM_COLOURS + (delta > 0 ? 1 : delta < 0 ? 2 : 0);
+  }
+  // Nothing is known about what is in a pruned directory
+  if (type == File::PRUNED) { return NUM_COLOURS; }
+  if (m_attribute_colours.empty()) { return node % NUM_COLOURS; }
+  if (type == File::DIRECTORY) { return NUM_COLOURS; }
+  const uint32_t id = AttributeOf(*m_tree, m_breakdown_attribute, node);
+  // Values that came after the ranking, e.g. from the watcher
+  if (id >= m_attribute_colours.size()) { return NUM_COLOURS - 1; }
+  return m_attribute_colours[id];
+}
+
+bool App::IsCovered(node_index_t dir, const SDL_FRect &rect,
+                    float scale) const {
+  if (m_layout.ChildRects(dir) == nullptr) { return false; }
+
+  uintmax_t children = 0;
+  for (node_index_t c : m_tree->Children(dir)) {
+    children += m_tree->Sizes()[c];
+  }
+  const uintmax_t size = m_tree->GetFile(dir).size;
+  const double uncovered = (double)rect.w * rect.h * scale * scale *
+                           (double)(size - children) / (double)size;
+  return uncovered < 1;
+}
+
+void App::DrawMap() {
+  int w, h;
+  SDL_GetWindowSize(window, &w, &h);
+  const int level = ZoomLevel();
+  int x0, y0, x1, y1;
+  TileRange(VisibleArea(), level, x0, y0, x1, y1);
+
+  for (int y = y0; y < y1; ++y) {
+    for (int x = x0; x < x1; ++x) {
+      // Not drawn yet, stretch part of a tile from a lower level instead
+      SDL_Rect src = {0, 0, TILE_SIZE, TILE_SIZE};
+      SDL_Texture *tile = m_tiles.Get({level, x, y});
+      for (int up = 1; tile == nullptr and up <= level; ++up) {
+        const int part = TILE_SIZE >> up;
+        if (part == 0) { break; }
+        tile = m_tiles.Get({level - up, x >> up, y >> up});
+        src = {(x & ((1 << up) - 1)) * part, (y & ((1 << up) - 1)) * part,
+               part, part};
+      }
+      if (tile == nullptr) { continue; }
+
+      const SDL_FRect area = TileCache::Area({level, x, y});
+      const SDL_FRect dst = {area.x * m_zoom + (1 - m_zoom) * w / 2 + m_offset.x,
+                             area.y * m_zoom + (1 - m_zoom) * h / 2 + m_offset.y,
+                             area.w * m_zoom, area.h * m_zoom};
+      SDL_RenderCopyF(renderer, tile, &src, &dst);
+    }
+  }
+}
+
+void App::ShowStats(bool show) {
+  m_show_stats = show;
+  if (show) { Stats::Enable(true); }
+}
+
+void App::DrawStats() {
+  ImGui::SetNextWindowPos({10.0f, 50.0f}, ImGuiCond_FirstUseEver);
+  ImGui::SetNextWindowBgAlpha(0.75f);
+  ImGui::Begin("Stats", &m_show_stats,
+               ImGuiWindowFlags_AlwaysAutoResize |
+                   ImGuiWindowFlags_NoSavedSettings |
+                   ImGuiWindowFlags_NoFocusOnAppearing |
+                   ImGuiWindowFlags_NoNav);
+
+  // Frames are only drawn when something changes, so there is no steady
+  // frame rate to show
+  const Stats::Totals frame = Stats::Get(Phase::FRAME);
+  ImGui::Text("Frame %.2f ms, %llu drawn", (double)frame.last_ns / 1e6,
+              (unsigned long long)frame.calls);
+
+  if (ImGui::BeginTable("phases", 5, ImGuiTableFlags_RowBg)) {
+    ImGui::TableSetupColumn("Phase");
+    ImGui::TableSetupColumn("Calls");
+    ImGui::TableSetupColumn("Total ms");
+    ImGui::TableSetupColumn("Avg ms");
+    ImGui::TableSetupColumn("Max ms");
+    ImGui::TableHeadersRow();
+    for (int i = 0; i < (int)Phase::NUM_PHASES; ++i) {
+      const Stats::Totals t = Stats::Get((Phase)i);
+      if (t.calls == 0) { continue; }
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      ImGui::TextUnformatted(Stats::Name((Phase)i));
+      ImGui::TableNextColumn();
+      ImGui::Text("%llu", (unsigned long long)t.calls);
+      ImGui::TableNextColumn();
+      ImGui::Text("%.1f", (double)t.wall_ns / 1e6);
+      ImGui::TableNextColumn();
+      ImGui::Text("%.3f", (double)t.wall_ns / 1e6 / (double)t.calls);
+      ImGui::TableNextColumn();
+      ImGui::Text("%.3f", (double)t.max_ns / 1e6);
+    }
+    ImGui::EndTable();
+  }
+
+  ImGui::Separator();
+  for (int i = 0; i < (int)Counter::NUM_COUNTERS; ++i) {
+    ImGui::Text("%s: %llu", Stats::Name((Counter)i),
+                (unsigned long long)Stats::Get((Counter)i));
+  }
+  ImGui::Text("nodes: %zu, %.1f MiB", m_tree->Size(),
+              (double)m_tree->MemoryUsage() / (1 << 20));
+  ImGui::Text("laid out rects: %zu", m_layout.Count());
+  ImGui::Text("peak memory: %.1f MiB",
+              (double)Stats::PeakMemory() / (1 << 20));
+  ImGui::End();
+}
+
+void App::Search() {
+  m_search = m_search_index.Search(m_search_text);
+  m_search_rects_stale = true;
+
+  m_search_top.assign(m_search.matches.begin(), m_search.matches.end());
+  const std::size_t n = std::min<std::size_t>(m_search_top.size(), 50);
+  const uintmax_t *sizes = m_tree->Sizes();
+  std::partial_sort(
+      m_search_top.begin(), m_search_top.begin() + n, m_search_top.end(),
+      [&](node_index_t a, node_index_t b) { return sizes[a] > sizes[b]; });
+  m_search_top.resize(n);
+}
+
+void App::DrawSearch() {
+  ImGui::SetNextWindowPos({10.0f, 50.0f}, ImGuiCond_FirstUseEver);
+  ImGui::SetNextWindowBgAlpha(0.75f);
+  ImGui::Begin("Search", &m_show_search,
+               ImGuiWindowFlags_AlwaysAutoResize |
+                   ImGuiWindowFlags_NoSavedSettings);
+
+  if (ImGui::IsWindowAppearing()) { ImGui::SetKeyboardFocusHere(); }
+  if (ImGui::InputText("name or *glob*", m_search_text,
+                       sizeof(m_search_text))) {
+    Search();
+  }
+
+  if (m_search_text[0]) {
+    ImGui::Text("%zu matches, %s", m_search.matches.size(),
+                FormatSize(m_search.size).str().c_str());
+    for (node_index_t m : m_search_top) {
+      ImGui::Text("%10s  %s", FormatSize(m_tree->GetFile(m).size).str().c_str(),
+                  m_tree->GetPath(m).string().c_str());
+    }
+  }
+  ImGui::End();
+
+  // Closing the box clears the search
+  if (!m_show_search) {
+    m_search_text[0] = '\0';
+    m_search = {};
+    m_search_top.clear();
+  }
+}
+
+void App::HighlightMatches() {
+  if (m_search_rects_stale) {
+    m_search_rects_stale = false;
+    int w, h;
+    SDL_GetWindowSize(window, &w, &h);
+    const float min_size = m_min_pixels / m_zoom;
+    const std::vector<SearchResult::Mark> &marks = m_search.marks;
+
+    m_search_rects.clear();
+    m_layout.ForEachIn(
+        VisibleArea(), min_size,
+        [&](node_index_t node, const SDL_FRect &rect, int) {
+          if (node >= marks.size() or marks[node] == SearchResult::NONE) {
+            return;
+          }
+          // Whatever matches below is too small to see
+          const bool is_leaf = m_layout.ChildRects(node) == nullptr or
+                               rect.w < min_size or rect.h < min_size;
+          if (marks[node] == SearchResult::MATCH or is_leaf) {
+            m_search_rects.push_back(
+                {rect.x * m_zoom + m_offset.x + (1 - m_zoom) * w / 2,
+                 rect.y * m_zoom + m_offset.y + (1 - m_zoom) * h / 2,
+                 std::max(rect.w * m_zoom, 1.0f),
+                 std::max(rect.h * m_zoom, 1.0f)});
+          }
+        });
+  }
+
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+  SDL_SetRenderDrawColor(renderer, 0xff, 0xff, 0xff, 0xa0);
+  SDL_RenderFillRectsF(renderer, m_search_rects.data(),
+                       (int)m_search_rects.size());
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+}
+
 void App::HighlightRect(node_index_t r) {
   SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-  SDL_FRect outline = m_rects[r];
+  SDL_FRect outline = m_layout.GetRect(r);
+  if (outline.w == 0 and outline.h == 0) { return; }
 
   int w, h;
   SDL_GetWindowSize(window, &w, &h);
@@ -365,3 +1025,104 @@ void App::HighlightRect(node_index_t r) {
     outline.h -= 2;
   }
 }
+
+void App::UpdateBreakdown() {
+  if (!m_breakdown_stale or !(m_show_breakdown or m_colour_by_attribute)) {
+    return;
+  }
+  m_breakdown_stale = false;
+  m_breakdown = Aggregate(*m_tree, m_focus);
+  UpdateColours();
+  Redraw();
+}
+
+void App::UpdateColours() {
+  std::vector<uint8_t> colours;
+  if (m_colour_by_attribute) {
+    const int a = (int)m_breakdown_attribute;
+    colours.assign(m_breakdown.totals[a].size(), NUM_COLOURS - 1);
+    const std::vector<uint32_t> ranked =
+        m_breakdown.Ranked(m_breakdown_attribute);
+    for (std::size_t k = 0; k < ranked.size() and k < NUM_COLOURS - 1; ++k) {
+      colours[ranked[k]] = (uint8_t)k;
+    }
+  }
+  if (colours != m_attribute_colours) {
+    m_attribute_colours.swap(colours);
+    m_tiles.Clear();
+    Redraw();
+  }
+}
+
+void App::DrawBreakdown() {
+  ImGui::SetNextWindowPos({10.0f, 50.0f}, ImGuiCond_FirstUseEver);
+  ImGui::SetNextWindowBgAlpha(0.75f);
+  ImGui::Begin("Breakdown", &m_show_breakdown,
+               ImGuiWindowFlags_AlwaysAutoResize |
+                   ImGuiWindowFlags_NoSavedSettings |
+                   ImGuiWindowFlags_NoFocusOnAppearing);
+
+  ImGui::TextUnformatted(m_tree->GetPath(m_focus).string().c_str());
+  ImGui::Text("%llu files, %s", (unsigned long long)m_breakdown.all.files,
+              FormatSize(m_breakdown.all.size).str().c_str());
+
+  static const char *const names[] = {"Extension", "Owner", "Age"};
+  int attribute = (int)m_breakdown_attribute;
+  bool changed = false;
+  for (int a = 0; a < (int)Attribute::NUM_ATTRIBUTES; ++a) {
+    if (a > 0) { ImGui::SameLine(); }
+    changed |= ImGui::RadioButton(names[a], &attribute, a);
+  }
+  changed |= ImGui::Checkbox("Colour the map", &m_colour_by_attribute);
+  if (changed) {
+    m_breakdown_attribute = (Attribute)attribute;
+    // The colours can come out the same for a different attribute
+    m_tiles.Clear();
+    UpdateColours();
+    Redraw();
+  }
+
+  const std::vector<AttributeTotal> &totals =
+      m_breakdown.totals[(int)m_breakdown_attribute];
+  const std::vector<uint32_t> ranked =
+      m_breakdown.Ranked(m_breakdown_attribute);
+  if (ImGui::BeginTable("breakdown", 5, ImGuiTableFlags_RowBg)) {
+    ImGui::TableSetupColumn("");
+    ImGui::TableSetupColumn(names[(int)m_breakdown_attribute]);
+    ImGui::TableSetupColumn("Files");
+    ImGui::TableSetupColumn("Size");
+    ImGui::TableSetupColumn("%");
+    ImGui::TableHeadersRow();
+    for (std::size_t k = 0; k < ranked.size() and k < MAX_BREAKDOWN_ROWS;
+         ++k) {
+      const uint32_t id = ranked[k];
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      if (id < m_attribute_colours.size()) {
+        const SDL_Colour c = m_palette[m_attribute_colours[id]];
+        ImGui::PushID((int)k);
+        ImGui::ColorButton("##colour",
+                           {c.r / 255.0f, c.g / 255.0f, c.b / 255.0f, 1.0f},
+                           ImGuiColorEditFlags_NoTooltip);
+        ImGui::PopID();
+      }
+      ImGui::TableNextColumn();
+      ImGui::TextUnformatted(
+          AttributeName(*m_tree, m_breakdown_attribute, id).c_str());
+      ImGui::TableNextColumn();
+      ImGui::Text("%llu", (unsigned long long)totals[id].files);
+      ImGui::TableNextColumn();
+      ImGui::TextUnformatted(FormatSize(totals[id].size).str().c_str());
+      ImGui::TableNextColumn();
+      ImGui::Text("%.1f", m_breakdown.all.size
+                              ? 100.0 * (double)totals[id].size /
+                                    (double)m_breakdown.all.size
+                              : 0.0);
+    }
+    ImGui::EndTable();
+  }
+  if (ranked.size() > MAX_BREAKDOWN_ROWS) {
+    ImGui::Text("and %zu more", ranked.size() - MAX_BREAKDOWN_ROWS);
+  }
+  ImGui::End();
+}